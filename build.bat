@@ -12,7 +12,7 @@
 @bin_to_h resources\OptimusPrinceps.ttf src\font_ttf.h
 @bin_to_h resources\Chess_Pieces.svg src\pieces_svg.h
 @del bin_to_h.exe
-@gcc src/chess.c src/engine.c SDL2_image.dll SDL2_ttf.dll libfreetype-6.dll -o chess.exe -Wall -Wextra -Wpedantic -Wimplicit-fallthrough=0 -lmingw32 -lSDL2main -lSDL2 -O3 -DWITH_BOOK -s
+@gcc src/chess.c src/engine.c SDL2_image.dll SDL2_ttf.dll libfreetype-6.dll -o chess.exe -Wall -Wextra -Wpedantic -Wimplicit-fallthrough=0 -lmingw32 -lSDL2main -lSDL2 -lpthread -O3 -DWITH_BOOK -s
 @del src\font_ttf.h
 @del src\pieces_svg.h
 @echo.
@@ -25,3 +25,11 @@
 @gcc src/chessx.c src/engine.c -o chessx.exe -Wall -Wextra -Wimplicit-fallthrough=0 -Wpedantic -lmingw32 -lpthread -O3 -DWITH_BOOK -s
 @del src\book.h
 @echo.
+@echo Compile the move generation test (perft)
+@echo ----------------------------------------
+@gcc src/perft.c src/engine.c -o perft.exe -Wall -Wextra -Wimplicit-fallthrough=0 -Wpedantic -lmingw32 -lpthread -O3 -s
+@echo.
+@echo Compile the engine kernels micro-benchmarks
+@echo -------------------------------------------
+@gcc src/bench_kernels.c -o bench_kernels.exe -Wall -Wextra -Wimplicit-fallthrough=0 -Wpedantic -lmingw32 -lpthread -O3 -s
+@echo.
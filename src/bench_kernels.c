@@ -0,0 +1,217 @@
+// Micro-benchmarks of the engine kernels: each one runs in a tight loop over the bench
+// positions, and its time per operation is measured several times to show the noise.
+// The kernels are static functions of engine.c, which is thus included rather than linked.
+
+#include <math.h>
+#include "engine.c"
+
+void log_info( const char* str )
+{
+    (void) str;
+}
+
+void send_str( const char* str )
+{
+    fputs( str, stdout );
+}
+
+#define NB_POSITIONS (int)(sizeof(bench_positions) / sizeof(bench_positions[0]))
+#define NB_MEASURES  10
+#define MEASURE_US   20000  // Minimum duration of a measure
+#define NB_KEYS      4096   // Random keys to probe the table with
+
+static engine_ctx_t* ctx_of[NB_POSITIONS];
+static int           side_of[NB_POSITIONS];
+static move_t        legal_moves[NB_POSITIONS][256];
+static int           nb_legal_moves[NB_POSITIONS];
+static uint64_t      random_keys[NB_KEYS];
+static volatile uint64_t sink;  // So that the compiler keeps the results
+
+// A kernel runs n times over the positions and returns the number of operations done
+typedef uint64_t (*kernel_t)( int n, int arg );
+
+static uint64_t zobrist_recompute( int n, int arg )
+{
+    uint64_t ops = 0, h = 0;
+    (void) arg;
+    while (n--)
+        for (int p = 0; p < NB_POSITIONS; p++, ops++) h ^= compute_hash( ctx_of[p] );
+    sink = h;
+    return ops;
+}
+
+static uint64_t check_test( int n, int arg )
+{
+    uint64_t ops = 0, c = 0;
+    (void) arg;
+    while (n--)
+        for (int p = 0; p < NB_POSITIONS; p++, ops += 2) {
+            engine_ctx_t* ctx = ctx_of[p];
+            c += in_check( ctx, WHITE, ctx->king_pos[(ctx->play + 1) & ~1] );
+            c += in_check( ctx, BLACK, ctx->king_pos[ctx->play | 1] );
+        }
+    sink = c;
+    return ops;
+}
+
+// The moves of the pieces of type arg
+static uint64_t moves_listing( int n, int arg )
+{
+    move_t list_of_moves[256];
+    uint64_t ops = 0, nb = 0;
+    while (n--)
+        for (int p = 0; p < NB_POSITIONS; p++) {
+            engine_ctx_t* ctx = ctx_of[p];
+            pieces_t* pl = &ctx->pieces[ctx->play];
+            for (int i = 0; i < pl->nb[SIDE_INDEX(side_of[p])]; i++) {
+                int sq = pl->sq[SIDE_INDEX(side_of[p])][i];
+                if ((B(sq) & TYPE) != arg) continue;
+                ctx->move_ptr = list_of_moves;
+                list_moves( ctx, sq );
+                nb += ctx->move_ptr - list_of_moves;
+                ops++;
+            }
+        }
+    sink = nb;
+    return ops;
+}
+
+static uint64_t make_unmake( int n, int arg )
+{
+    uint64_t ops = 0;
+    (void) arg;
+    while (n--)
+        for (int p = 0; p < NB_POSITIONS; p++) {
+            engine_ctx_t* ctx = ctx_of[p];
+            for (int i = 0; i < nb_legal_moves[p]; i++, ops++) {
+                do_move( ctx, legal_moves[p][i] );
+                undo_move( ctx );
+            }
+        }
+    return ops;
+}
+
+static uint64_t evaluation( int n, int arg )
+{
+    uint64_t ops = 0, v = 0;
+    (void) arg;
+    while (n--)
+        for (int p = 0; p < NB_POSITIONS; p++, ops++) v += evaluate( ctx_of[p], side_of[p] );
+    sink = v;
+    return ops;
+}
+
+// All the moves of a board, by the staged move picker, in the order they would be tried
+static uint64_t moves_picking( int n, int arg )
+{
+    picker_t picker;
+    move_t no_move, *m;
+    uint64_t ops = 0, nb = 0;
+    (void) arg;
+    no_move.val = 0;
+    while (n--)
+        for (int p = 0; p < NB_POSITIONS; p++, ops++) {
+            init_picker( ctx_of[p], &picker, side_of[p], 0, no_move );
+            while ((m = next_move( ctx_of[p], &picker, 0 ))) nb += m->to;
+        }
+    sink = nb;
+    return ops;
+}
+
+// arg 0: probe the positions, which are in the table, 1: probe random keys, which are not
+static uint64_t table_probe( int n, int arg )
+{
+    int flag, eval;
+    move_t move;
+    uint64_t ops = 0, found = 0;
+    while (n--) {
+        if (arg == 0)
+            for (int p = 0; p < NB_POSITIONS; p++, ops++)
+                found += get_table_entry( ctx_of[p], 4, side_of[p], &flag, &eval, &move );
+        else {
+            engine_ctx_t* ctx = ctx_of[0];
+            uint64_t hash = ctx->board_hash[ctx->play];
+            for (int k = 0; k < NB_KEYS; k++, ops++) {
+                ctx->board_hash[ctx->play] = random_keys[k];
+                found += get_table_entry( ctx, 4, side_of[0], &flag, &eval, &move );
+            }
+            ctx->board_hash[ctx->play] = hash;
+        }
+    }
+    sink = found;
+    return ops;
+}
+
+static long measure_us( kernel_t k, int n, int arg, uint64_t* ops )
+{
+    struct timeval tv0, tv1;
+    gettimeofday( &tv0, NULL );
+    *ops = k( n, arg );
+    gettimeofday( &tv1, NULL );
+    return (tv1.tv_sec - tv0.tv_sec) * 1000000 + (tv1.tv_usec - tv0.tv_usec);
+}
+
+static void run( const char* name, kernel_t k, int arg )
+{
+    double ns[NB_MEASURES], mean = 0, var = 0, min = 1e30;
+    uint64_t ops;
+    int n = 1;
+
+    // Repeat the loop enough for a measure to last MEASURE_US
+    while (measure_us( k, n, arg, &ops ) < MEASURE_US && ops) n *= 2;
+    if (ops == 0) return;
+
+    for (int i = 0; i < NB_MEASURES; i++) {
+        ns[i] = 1000.0 * measure_us( k, n, arg, &ops ) / ops;
+        mean += ns[i] / NB_MEASURES;
+        if (ns[i] < min) min = ns[i];
+    }
+    for (int i = 0; i < NB_MEASURES; i++) var += (ns[i] - mean) * (ns[i] - mean) / NB_MEASURES;
+    printf( "%-22s %9.1f %8.1f %9.1f %12llu\n", name, mean, sqrt( var ), min, (unsigned long long)ops );
+}
+
+int main( void )
+{
+    legality_t lg;
+    uint64_t state = 0x1234;
+
+    set_table_size( 16 );
+    for (int p = 0; p < NB_POSITIONS; p++) {
+        engine_ctx_t* ctx = ctx_of[p] = new_engine_ctx();
+        if (ctx == NULL) return 1;
+        ctx_init_game( ctx, bench_positions[p] );
+        side_of[p] = (ctx->play & 1) ? BLACK : WHITE;
+
+        // The legal moves, and a table entry for the board
+        move_t list_of_moves[256], *m;
+        list_pins_and_checks( ctx, side_of[p], &lg );
+        ctx->move_ptr = list_of_moves;
+        if (lg.nb_checkers) list_evasions( ctx, side_of[p], &lg );
+        else
+            for (int i = 0; i < ctx->pieces[ctx->play].nb[SIDE_INDEX(side_of[p])]; i++)
+                list_moves( ctx, ctx->pieces[ctx->play].sq[SIDE_INDEX(side_of[p])][i] );
+        for (m = list_of_moves; m < ctx->move_ptr; m++)
+            if (is_legal( ctx, &lg, *m )) legal_moves[p][nb_legal_moves[p]++] = *m;
+        set_table_entry( ctx, 4, EXACT_VALUE, 0, legal_moves[p][0] );
+    }
+    for (int k = 0; k < NB_KEYS; k++) random_keys[k] = splitmix64( &state );
+
+    printf( "%d positions, %d measures per kernel\n", NB_POSITIONS, NB_MEASURES );
+    printf( "%-22s %9s %8s %9s %12s\n", "kernel", "ns/op", "+/-", "min", "ops/measure" );
+    run( "compute_hash",        zobrist_recompute, 0 );
+    run( "in_check",            check_test, 0 );
+    run( "list_moves pawn",     moves_listing, PAWN );
+    run( "list_moves knight",   moves_listing, KNIGHT );
+    run( "list_moves bishop",   moves_listing, BISHOP );
+    run( "list_moves rook",     moves_listing, ROOK );
+    run( "list_moves queen",    moves_listing, QUEEN );
+    run( "list_moves king",     moves_listing, KING );
+    run( "do_move + undo_move", make_unmake, 0 );
+    run( "evaluate",            evaluation, 0 );
+    run( "move picker (board)", moves_picking, 0 );
+    run( "get_table_entry hit", table_probe, 0 );
+    run( "get_table_entry miss", table_probe, 1 );
+
+    for (int p = 0; p < NB_POSITIONS; p++) free_engine_ctx( ctx_of[p] );
+    return 0;
+}
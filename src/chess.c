@@ -686,7 +686,6 @@ static int handle_user_turn(char* move_str)
 
 int main(int argc, char* argv[])
 {
-    (void)argc;
     char move_str[8];
 
     // A few inits
@@ -695,6 +694,9 @@ int main(int argc, char* argv[])
     else if ((name = strrchr(argv[0], '\\'))) name++;  // Windows
     else name = argv[0];
     graphical_inits(name);
+
+    // Optional transposition table size in MB: chess -hash 1024
+    if (argc > 2 && !strcmp(argv[1], "-hash")) set_table_size(atoi(argv[2]));
     init_game(NULL);
     load_game();
     randomize = 1;
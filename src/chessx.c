@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <signal.h>
+#include <sys/time.h>
 #include "engine.h"
 
 //------------------------------------------------------------------------------------
@@ -79,6 +80,85 @@ static void budget_next_play_time( int remaining_time_ms)
     else                    set_next_play_time( remaining_time_ms);
 }
 
+//------------------------------------------------------------------------------------
+// Engine options set by the GUI (see the "feature option" list in protover)
+//------------------------------------------------------------------------------------
+
+static void set_option( char* arg)
+{
+    char* value = strchr( arg, '=');
+    if (value == NULL) return;
+    *(value++) = 0;
+
+    if (!strcmp(arg, "Keep hash between positions")) keep_table = atoi(value);
+}
+
+//------------------------------------------------------------------------------------
+// Speed tests (not xboard commands): perft 5, divide 5, bench 7 16, epd wac.epd 5000
+//------------------------------------------------------------------------------------
+
+static void send_speed( uint64_t nodes, struct timeval* tv0 )
+{
+    struct timeval tv1;
+    gettimeofday( &tv1, NULL );
+
+    long ms = (tv1.tv_sec - tv0->tv_sec) * 1000 + (tv1.tv_usec - tv0->tv_usec) / 1000;
+    send_str_va( "nodes %llu\n", (unsigned long long)nodes );
+    send_str_va( "time %ld ms, %.2f Mnps\n", ms, ms ? nodes / (1000.0 * ms) : 0.0 );
+}
+
+static void run_perft( char* arg, int divide )
+{
+    struct timeval tv0;
+    int depth = arg ? atoi(arg) : 1;
+
+    gettimeofday( &tv0, NULL );
+    send_speed( perft( depth, divide ), &tv0 );
+}
+
+// The default depth and table size give the reference signature (with 1 thread)
+static void run_bench( char* arg )
+{
+    struct timeval tv0;
+    int depth = 7, hash_mb = 16;
+    if (arg) sscanf( arg, "%d %d", &depth, &hash_mb );
+
+    gettimeofday( &tv0, NULL );
+    send_speed( bench( depth, hash_mb ), &tv0 );
+}
+
+// Run a test suite: epd file.epd [ms [moves]]. The unsolved positions count for
+// their whole search in the time and moves to solution
+static void run_epd( char* arg )
+{
+    char file_name[128], line[512];
+    long ms = 5000, max_moves = 0, total_ms = 0, total_moves = 0;
+    int  nb = 0, solved = 0;
+    epd_result_t res;
+
+    if (arg == NULL || sscanf( arg, "%127s %ld %ld", file_name, &ms, &max_moves ) < 1) return;
+
+    FILE* f = fopen( file_name, "r" );
+    if (f == NULL) { send_str_va( "Error (cannot open): %.40s\n", file_name ); return; }
+    engine_ctx_t* ctx = new_engine_ctx();
+    if (ctx == NULL) { fclose( f ); return; }
+
+    while (fgets( line, sizeof(line), f )) {
+        if (ctx_epd_search( ctx, line, ms, max_moves, &res ) < 0) continue;
+        nb++;
+        solved      += res.solved;
+        total_ms    += res.tts_ms;
+        total_moves += res.tts_moves;
+        send_str_va( "%-12.12s %-5s %-3s %7ld ms %10ld moves\n", res.id[0] ? res.id : "-", res.move, res.solved ? "ok" : "BAD", res.tts_ms, res.tts_moves );
+    }
+    send_str_va( "solved %d / %d\n", solved, nb );
+    send_str_va( "time to solution %ld ms\n", total_ms );
+    send_str_va( "moves to solution %ld\n", total_moves );
+
+    free_engine_ctx( ctx );
+    fclose( f );
+}
+
 //------------------------------------------------------------------------------------
 // Infinite loop looking at xboard commands received via stdin
 //------------------------------------------------------------------------------------
@@ -93,8 +173,6 @@ void intHandler( int unused )
 
 int main(int argc, char* argv[])
 {
-    (void) argc;
-    
     char* name;
     char cmd[128];
     char* arg;
@@ -114,6 +192,31 @@ int main(int argc, char* argv[])
     setbuf(stdin, NULL);
     setbuf(stdout, NULL);
 
+    // Options, in any order:
+    //   -hash 1024                  transposition table size in MB
+    //   -bench [depth [hash]]       search speed test, then exit
+    //   -epd file.epd [ms [moves]]  test suite, then exit
+    char run_arg[192] = "";
+    void (*run_test)( char* ) = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-hash") && i + 1 < argc) { set_table_size( atoi(argv[++i]) ); continue; }
+        if      (!strcmp(argv[i], "-bench")) run_test = run_bench;
+        else if (!strcmp(argv[i], "-epd"))   run_test = run_epd;
+        else continue;
+
+        // The arguments of the test are the words up to the next option
+        run_arg[0] = 0;
+        while (i + 1 < argc && argv[i + 1][0] != '-') {
+            size_t len = strlen( run_arg );
+            snprintf( run_arg + len, sizeof(run_arg) - len, "%.127s ", argv[++i] );
+        }
+    }
+    if (run_test) {
+        run_test( run_arg[0] ? run_arg : NULL );
+        fclose( logfile );
+        return 0;
+    }
+
     init_game( NULL );
 
     while (1) {
@@ -147,6 +250,9 @@ int main(int argc, char* argv[])
         if (!strcmp(cmd, "protover")) {
             send_str("feature myname=\""); send_str(name); send_str("\"\n");
             send_str("feature ping=1\n");
+            send_str("feature memory=1\n");
+            send_str("feature smp=1\n");
+            send_str("feature option=\"Keep hash between positions -check 0\"\n");
             send_str("feature sigint=0\n");
             send_str("feature sigterm=0\n");
             send_str("feature variants=\"normal\"\n");
@@ -154,7 +260,7 @@ int main(int argc, char* argv[])
         }
         else if (!strcmp(cmd, "ping"))     send_str_va( "pong %s\n", arg);
         else if (!strcmp(cmd, "new"))    { init_game( NULL ); go = 1; }
-        else if (!strcmp(cmd, "quit"))     break;
+        else if (!strcmp(cmd, "quit"))   { send_profile(); break; }
         else if (!strcmp(cmd, "force"))    go = 0;
         else if (!strcmp(cmd, "go"))     { go = 1; game_state = THINK_GS; }
         else if (!strcmp(cmd, "sd"))     { level_max_max = atoi(arg); if (level_max_max > LEVEL_MAX) level_max_max = LEVEL_MAX; }
@@ -166,6 +272,18 @@ int main(int argc, char* argv[])
         else if (!strcmp(cmd, "level"))    set_time_ctrl( arg);
         else if (!strcmp(cmd, "time"))     budget_next_play_time( atoi(arg) * 10);
         else if (!strcmp(cmd, "st"))       set_next_play_time( atoi(arg) * 1000);
+        // (not while the search thread uses the table and the game)
+        else if (game_state == THINK_GS && (!strcmp(cmd, "memory") || !strcmp(cmd, "perft") || !strcmp(cmd, "divide") ||
+                                            !strcmp(cmd, "bench")  || !strcmp(cmd, "epd")))
+            send_str_va( "Error (engine is thinking): %s\n", cmd );
+        else if (!strcmp(cmd, "memory"))   set_table_size( atoi(arg) );
+        else if (!strcmp(cmd, "cores"))  { nb_threads = atoi(arg); if (nb_threads < 1) nb_threads = 1; if (nb_threads > MAX_THREADS) nb_threads = MAX_THREADS; }
+        else if (!strcmp(cmd, "option"))   set_option( arg );
+        else if (!strcmp(cmd, "perft"))    run_perft( arg, 0 );
+        else if (!strcmp(cmd, "divide"))   run_perft( arg, 1 );
+        else if (!strcmp(cmd, "bench"))    run_bench( arg );
+        else if (!strcmp(cmd, "epd"))      run_epd( arg );
+        else if (!strcmp(cmd, "stats"))  { char json[1024]; search_stats( json, sizeof(json) ); send_str( json ); }
 
         // Silently ignore the following xboard commands
         else if (
@@ -1,6 +1,15 @@
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <x86intrin.h>  // for __rdtsc()
 
+#ifdef __MINGW32__
+#include <windows.h>    // for VirtualAlloc()
+#else
+#include <sys/mman.h>   // for mmap() and madvise()
+#endif
+
 #include "engine.h"
 
 // Chess pieces
@@ -37,11 +46,8 @@ enum piece_t {
 #define NO_POSITION           79  // an impossible position
 #define MAX_TURNS             500
 
-static char boards[FIRST_BOARDER_SIZE + BOARD_AND_BORDER_SIZE * MAX_TURNS] __attribute__((aligned(16)));
-
-#define BOARD0 &boards[FIRST_BOARDER_SIZE]
-char *board_ptr = BOARD0;
-#define B(x)        (*(board_ptr + (x)))
+#define BOARD0(ctx)  &(ctx)->boards[FIRST_BOARDER_SIZE]
+#define B(x)        (*(ctx->board_ptr + (x)))
 #define Board(l, c) B(10 * (l) + (c))
 
 // Move structure and move tables
@@ -69,8 +75,6 @@ typedef struct {
     };
 } move_t;
 
-static move_t best_sequence[LEVEL_MAX + 1], best_move[LEVEL_MAX + 1], next_best[LEVEL_MAX + 1];
-
 // Transposition table to store move choices for each encountered board situations
 #define NEW_BOARD   0
 #define OTHER_DEPTH 1
@@ -78,40 +82,53 @@ static move_t best_sequence[LEVEL_MAX + 1], best_move[LEVEL_MAX + 1], next_best[
 #define LOWER_BOUND 3
 #define EXACT_VALUE 4
 
+// The table is shared by the search threads without lock: an entry is written as two
+// 64-bit words, the data and the Zobrist key XOR the data, so that an entry half written
+// by another thread does not match. The low byte of the key is implied by the cluster and
+// holds the generation instead, which a probe refreshes without rewriting the check.
 typedef struct {
+    uint64_t check;                 // Zobrist key ^ data, apart from the low byte
     union {
-        uint64_t hash;      // Pengy hash. Useless LSB taken for depth & flag => 16B table entry size
-        struct {            // /!\ struct for little endian CPU !
-            uint8_t  depth;
-            uint8_t  flag;
-            uint16_t dummy[3];
+        uint64_t data;
+        struct {
+            uint64_t generation : 8;   // Search that wrote the entry, to age entries out
+            uint64_t from : 7, to : 7, eaten : 5, special : 4;  // The move
+            uint64_t depth      : 6;
+            uint64_t flag       : 3;
+            int64_t  eval       : 24;
         };
     };
-    move_t   move;
-    int32_t  eval;
-} table_t;
-
-#define TABLE_ENTRIES (1 << 23) // 8 Mega entries.x 16B = 128 MB memory
-static table_t table[TABLE_ENTRIES] __attribute__((aligned(16)));
+} table_t;                          // 16B table entry size
 
-// Move choosen by the chess engine
-char *engine_move_str;
+#define entry_matches(e, hash) ((((e)->check ^ (e)->data ^ (hash)) >> 8) == 0)
 
-int game_state = WAIT_GS;
+// Entries are grouped in 64B clusters (one cache line) probed together
+#define CLUSTER_SIZE 4
+typedef struct {
+    table_t entry[CLUSTER_SIZE];
+} cluster_t;
 
-int play            = 0;
-int nb_plays        = 0;
+// The table is allocated at run time. Its number of clusters is a power of 2
+#define TABLE_DEFAULT_MB 128  // 2 Mega clusters x 64B
+typedef struct {
+    cluster_t *clusters;
+    size_t size;      // in bytes
+    uint64_t mask;    // number of clusters - 1
+} trans_table_t;
+static trans_table_t shared_table;  // The table of all the games (a bench game has its own)
+static uint8_t table_generation;    // Incremented at each search
+
+// An entry is valid if written since the epoch of the game: no need to clear the table for a new game
+#define table_entry_age(e)  ((uint8_t)(table_generation - (e)->generation))
+#define is_stale(ctx, e)    ((e)->flag == NEW_BOARD || table_entry_age(e) > (uint8_t)(table_generation - (ctx)->table_epoch))
+
+// Settings of the play interfaces, given to their game before each search
 int verbose         = 1;
 int use_book        = 1;
-int randomize       = 0;
-int level_max_max   = LEVEL_MAX;
-long time_budget_ms = 2000;
-long curr_budget_ms = 0;
-long unused_ms      = 0;
-static int mv50     = 0;
-static char engine_side;
+int keep_table      = 0;
 
-// The first moves we accept to play
+// The first moves we accept to play, from the start position only
+static uint64_t start_hash;
 static const move_t first_ply[5] = {
     {.from =  6, .to = 25},
     {.from = 12, .to = 32},
@@ -119,24 +136,161 @@ static const move_t first_ply[5] = {
     {.from = 14, .to = 34},
     {.from = 16, .to = 26} };
 
-static move_t *move_ptr;
-
-// Track of the situation at all turns
-static move_t moved[MAX_TURNS];
-static int board_val[MAX_TURNS];
-static int nb_pieces[MAX_TURNS];
-
-// Possible place to eat "en passant" a pawn that moved two rows.
-static char en_passant[MAX_TURNS];
+// Directions of the moves
+static const int qb_inc[4] = {9, 11, -9, -11};
+static const int qr_inc[4] = {10, 1, -10, -1};
+static const int king_inc[8]   = {9, 10, 11, 1, -9, -10, -11, -1};
+static const int knight_inc[8] = {8, 12, 19, 21, -8, -12, -19, -21};
 
 // Castle rules: involved rook and king must not have moved before the castle
 #define LEFT_CASTLE  1
 #define RIGHT_CASTLE 2
 #define ALL_CASTLES  3
-static char castles[MAX_TURNS + 2];  // (even index: white castle, odd index: black castle)
 
-// Keep track of kings positions
-static int king_pos[MAX_TURNS + 2];  // (even index: white king, odd index: black king)
+// Evaluation terms of a board, updated by set_square() at each change (positive values are good for black)
+typedef struct {
+    int board_val;       // Material
+    int nb_pieces;
+    int phase;           // PHASE_MAX at the beginning of the game, 0 when only kings and pawns are left
+    int pos_mg, pos_eg;  // Piece positions, for the middle game and for the end game
+    int pawn_front;      // Own pieces in front of pawns
+} eval_t;
+
+// Piece lists of a board, updated by set_square() at each change: the squares of the
+// pieces of each side, and for each square, its index in the list of its side
+#define SIDE_INDEX(side) ((side) >> 4)  // 0 for WHITE, 1 for BLACK
+typedef struct {
+    uint8_t nb[2];
+    uint8_t sq[2][16 + 1];  // (+1: while a piece moves, it is on both squares)
+    uint8_t index[BOARD_SIZE];
+} pieces_t;
+
+#ifdef BITBOARDS
+// Bitboards of a board, updated by set_square() at each change: for each side, a set of
+// squares (bit 8 * line + column) per piece type, and at index 0, all the pieces of the side
+typedef struct {
+    uint64_t bb[2][8];
+} bitboards_t;
+#endif
+
+#ifdef PROFILE
+// Profile build (-DPROFILE): each hot function f is wrapped by profiled_f, which counts its
+// calls and TSC cycles in the search statistics, and which the code after f calls instead
+enum profiled_t { PROF_DO_MOVE, PROF_IN_CHECK, PROF_LIST_MOVES, PROF_PINS_AND_CHECKS, PROF_IS_LEGAL,
+                  PROF_EVALUATE, PROF_GET_TABLE_ENTRY, PROF_NEXT_MOVE, NB_PROFILED };
+static const char *profiled_names[NB_PROFILED] = { "do_move", "in_check", "list_moves", "list_pins_and_checks",
+                                                   "is_legal", "evaluate", "get_table_entry", "next_move" };
+
+#define PROFILE_ADD(id, t0) (ctx->stats.calls[id]++, ctx->stats.cycles[id] += __rdtsc() - (t0))
+#define PROFILED(type, f, id, params, args) \
+    static type profiled_##f params { uint64_t t0 = __rdtsc(); type r = f args; PROFILE_ADD(id, t0); return r; }
+#define PROFILED_VOID(f, id, params, args) \
+    static void profiled_##f params { uint64_t t0 = __rdtsc(); f args; PROFILE_ADD(id, t0); }
+#endif
+
+// Statistics of a search, to follow its efficiency. The helpers add theirs at the end
+typedef struct {
+    long q_nodes;                             // Boards searched by quiesce()
+    long tt_probes, tt_hits, tt_cutoffs;      // Transposition table
+    long cutoffs, first_move_cutoffs;         // Beta cutoffs, and those by the first move
+    long futility_prunes;
+    long null_cutoffs;                        // Null moves that failed high (and were verified)
+    long reductions, re_searches;             // Late moves searched less deep, and again at full depth
+    long window_fails;                        // Root searches that fell out of the aspiration window
+    int  window;                              // Width of the last aspiration window (0: full)
+    long level_moves[LEVEL_MAX + 1];          // Moves searched by the main thread per level
+    long moves, ms;
+    int  level;                               // Last completed level
+#ifdef PROFILE
+    uint64_t calls[NB_PROFILED], cycles[NB_PROFILED], search_cycles;  // Of the main thread
+#endif
+} search_stats_t;
+
+#define MOVE_STACK_SIZE    (128 * 320)  // The moves of a LEVEL_MAX deep path, and of its quiescence search
+#define MAX_BOARD_MOVES    256          // The most moves a board lists
+#define MOVE_STACK(ctx)    ((move_t *)(((uintptr_t)(ctx)->move_stack + 63) & ~(uintptr_t)63))  // (calloc does not align it)
+#define MOVE_SCORE(ctx, m) ((ctx)->move_score + ((m) - (ctx)->move_stack))
+
+// Each game is an engine context: the boards of all turns, the situation at all turns,
+// the game settings and the search state. Each search thread works on its own copy.
+struct engine_ctx {
+    char boards[FIRST_BOARDER_SIZE + BOARD_AND_BORDER_SIZE * MAX_TURNS] __attribute__((aligned(16)));
+    char *board_ptr;
+    int play, nb_plays;
+
+    // Track of the situation at all turns
+    move_t moved[MAX_TURNS];
+    eval_t eval[MAX_TURNS];
+    pieces_t pieces[MAX_TURNS];
+#ifdef BITBOARDS
+    bitboards_t bitboards[MAX_TURNS];
+#endif
+    uint64_t board_hash[MAX_TURNS];  // Zobrist key of the board at each ply
+
+    // Possible place to eat "en passant" a pawn that moved two rows.
+    char en_passant[MAX_TURNS];
+
+    char castles[MAX_TURNS + 2];  // (even index: white castle, odd index: black castle)
+
+    // Keep track of kings positions
+    int king_pos[MAX_TURNS + 2];  // (even index: white king, odd index: black king)
+
+    // Game state and settings
+    int game_state;
+    int mv50;
+    char engine_side;
+    char engine_move_str[8];
+    char mv_str[8];
+    int randomize;
+    int level_max_max;
+    int use_book, verbose;
+    uint8_t table_epoch;     // Table entries written by searches before this one are stale
+    trans_table_t *table;    // The shared table, unless the game has its own
+    long time_budget_ms, curr_budget_ms, unused_ms, total_ms;
+    struct timeval tv0;
+
+    // Search state
+    move_t *move_ptr;
+    move_t best_move[LEVEL_MAX + 1], next_best[LEVEL_MAX + 1];
+    move_t pv[LEVEL_MAX + 1][LEVEL_MAX + 1];  // Triangular: the best sequence found at each level, from it
+    int pv_length[LEVEL_MAX + 1];             // The level where this sequence ends
+    int level_max;
+
+    // Quiet move ordering, learnt from the beta cutoffs and kept (aged) from a search to the next
+    int16_t history[2][BOARD_SIZE][BOARD_SIZE];               // side, from, to
+    move_t  counter_move[BOARD_SIZE][BOARD_SIZE];             // The reply to the previous move (from, to)
+    int16_t cont_history[6][BOARD_SIZE][6][BOARD_SIZE];       // After a piece type to a square, a piece type to a square
+    int ab_moves, next_ab_moves_time_check;
+    long nb_moves;  // ab_moves of the previous levels
+    long searched_moves;  // By the last search, helpers included
+    long max_moves;       // Stop the search after that many moves, 0 for no limit
+
+    // Test position: the moves to find (bm) or to avoid (am), and when the last
+    // completed level found a solution that the following levels kept
+    move_t best_moves[8], avoid_moves[8];
+    int nb_best_moves, nb_avoid_moves;
+    long solved_ms, solved_moves;  // -1 while not solved
+    search_stats_t stats;
+    int no_null;  // Set while verifying a null move cutoff
+
+    // The moves listed by the boards of a search path, each board above its parent, so that
+    // the recursion frames stay small and the lists of the path stay in the same cache lines
+    move_t *move_top;                         // Where the next board lists its moves
+    move_t move_stack[MOVE_STACK_SIZE + 16];  // (+16 to start on a cache line, see MOVE_STACK)
+    int    move_score[MOVE_STACK_SIZE + 16];  // The score of the move at the same index, to pick it
+
+    // Lazy SMP: the game context (root) starts helper threads, each with its own copy
+    engine_ctx_t *root;
+    volatile int stop_search;  // Set in the root context when time's up
+    int thread_id;
+    int nb_helpers;
+    engine_ctx_t *helper_ctx[MAX_THREADS];
+    pthread_t helper_thread[MAX_THREADS];
+};
+
+int nb_threads = 1;
+
+static engine_ctx_t *main_ctx;  // The game of the play interfaces (see the end of the file)
 
 //                                  -   P,   P,    K,   N,   B,   R,   Q
 static const int piece_value[33] = {0, 100, 100, 4000, 300, 314, 500, 900,
@@ -181,11 +335,392 @@ static const int king_pos_malus[BOARD_SIZE] = {
 #include "book.h"
 #endif
 
+//------------------------------------------------------------------------------------
+// Zobrist keys used for the openings book and transposition table
+//------------------------------------------------------------------------------------
+
+// One random key per (piece, square), per castle state of each side, per "en passant"
+// location and for the side to play. The board key is the XOR of the keys of all that
+// is present, so do_move(ctx) only has to XOR the keys of what it changes.
+// /!\ mk_book.c generates the same keys to build the book: keep both in sync.
+static uint64_t zobrist_piece[STOP + 1][BOARD_SIZE]; // Empty and border squares stay 0
+static uint64_t zobrist_castle[2][ALL_CASTLES + 1];  // [0]: white castles, [1]: black castles
+static uint64_t zobrist_en_passant[BOARD_SIZE];      // [NO_POSITION] stays 0
+static uint64_t zobrist_side;                         // Set when black is to play
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void init_zobrist(void)
+{
+    uint64_t state = 0x1234567890ABCDEFULL;
+    int piece, sq, c;
+
+    memset(zobrist_piece, 0, sizeof(zobrist_piece));
+    memset(zobrist_en_passant, 0, sizeof(zobrist_en_passant));
+
+    for (piece = W_PAWN; piece < COLORS; piece++) {
+        if ((piece & TYPE) < PAWN) continue;
+        for (sq = 0; sq < BOARD_SIZE - 2; sq++) zobrist_piece[piece][sq] = splitmix64(&state);
+    }
+    for (c = 0; c < 2; c++)
+        for (sq = 0; sq <= ALL_CASTLES; sq++) zobrist_castle[c][sq] = splitmix64(&state);
+    for (sq = 20; sq < 60; sq++) zobrist_en_passant[sq] = splitmix64(&state);
+    zobrist_side = splitmix64(&state);
+}
+
+// Full computation of the board key. do_move(ctx) maintains it incrementally
+static uint64_t compute_hash(engine_ctx_t *ctx)
+{
+    uint64_t hash = (ctx->play & 1) ? zobrist_side : 0;
+
+    for (int sq = 0; sq < BOARD_SIZE - 2; sq++)
+        if (B(sq) & COLORS) hash ^= zobrist_piece[(int)B(sq)][sq];
+
+    hash ^= zobrist_castle[ctx->play & 1][(int)ctx->castles[ctx->play]];
+    hash ^= zobrist_castle[(ctx->play & 1) ^ 1][(int)ctx->castles[ctx->play + 1]];
+    hash ^= zobrist_en_passant[(int)ctx->en_passant[ctx->play]];
+    return hash;
+}
+
+//------------------------------------------------------------------------------------
+// Rays: from a square to another one on the same line, the direction to follow
+//------------------------------------------------------------------------------------
+
+#define ON_BOARD(sq) ((sq) >= 0 && (sq) < BOARD_SIZE - 2 && (sq) % 10 <= 7)
+
+// Indexed by BOARD_SIZE + to - from. Only a walk from 'from' tells if 'to' is really reached
+static signed char ray_inc[2 * BOARD_SIZE];
+static char ray_piece[2 * BOARD_SIZE];  // BISHOP or ROOK, the piece that moves along the ray
+
+static void init_rays(void)
+{
+    for (int from = 0; from < BOARD_SIZE - 2; from++) {
+        if (!ON_BOARD(from)) continue;
+        for (int i = 0; i < 8; i++) {
+            int inc = king_inc[i];
+            for (int to = from + inc; ON_BOARD(to); to += inc) {
+                ray_inc[BOARD_SIZE + to - from]   = inc;
+                ray_piece[BOARD_SIZE + to - from] = (inc == 9 || inc == 11 || inc == -9 || inc == -11) ? BISHOP : ROOK;
+            }
+        }
+    }
+}
+
+#ifdef BITBOARDS
+//------------------------------------------------------------------------------------
+// Bitboards (build with -DBITBOARDS): attacks are looked up in tables instead of walked.
+// The sliding attacks are indexed by the occupancy of their rays, with magic numbers,
+// or with the PEXT instruction when it is available (build with -mbmi2)
+//------------------------------------------------------------------------------------
+
+#define SQ64(sq) ((sq) - 2 * ((sq) / 10))  // Board square to bit
+#define SQ10(b)  ((b) + 2 * ((b) >> 3))    // Bit to board square
+#define BIT(sq)  (1ULL << SQ64(sq))
+
+static uint64_t knight_attacks[64], king_attacks[64];
+static uint64_t pawn_attacks[2][64];  // Squares attacked by a white ([0]) or a black ([1]) pawn
+static uint64_t between[64][64];      // Squares between two aligned squares
+
+typedef struct {
+    uint64_t mask;  // The squares of the rays whose occupancy matters (not the last ones)
+    uint64_t magic;
+    uint64_t *attacks;
+    int shift;
+} magic_t;
+
+static magic_t bishop_magic[64], rook_magic[64];
+static uint64_t bishop_table[5248], rook_table[102400];
+
+// Magic numbers found by init_magic(), so that it does not have to search them again
+static const uint64_t bishop_magics[64] = {
+    0x0022441802085200ULL, 0x0020010116068000ULL, 0x1144282091040001ULL, 0x0004410020900008ULL,
+    0x6041104010000000ULL, 0x8012024220800250ULL, 0x2004089410080120ULL, 0x04508A0801010800ULL,
+    0x202088882800C400ULL, 0x90020408022C0020ULL, 0x88028884810A0401ULL, 0x0410042502000084ULL,
+    0x1120011040004208ULL, 0x20000104A2402080ULL, 0x0081210C30040509ULL, 0x0002044848084800ULL,
+    0x10C0810810210204ULL, 0x08081B8401082200ULL, 0x0140404404088112ULL, 0x4429000820420001ULL,
+    0x4004000200940002ULL, 0x0001A00410080820ULL, 0x100A000111012000ULL, 0x0A00421084040100ULL,
+    0x0442500040B11210ULL, 0x0C1038000C182280ULL, 0x068A020060480041ULL, 0x0040040082020808ULL,
+    0x4910101001004000ULL, 0x1201010002004140ULL, 0x1062008406080141ULL, 0x8092202008440210ULL,
+    0x0222202000040820ULL, 0x0981100200104440ULL, 0x003400AA000C0410ULL, 0x4040020081280080ULL,
+    0x0420028400028020ULL, 0x1210360808008080ULL, 0x2408016400810081ULL, 0x5005060020620312ULL,
+    0x0512100321030801ULL, 0x0200442220080800ULL, 0x4441420040400400ULL, 0x2020002018000108ULL,
+    0xE201081051400400ULL, 0x0005820802C03202ULL, 0x0020440400800044ULL, 0x082801040232808BULL,
+    0x0044140109081400ULL, 0x8200220210041000ULL, 0x0800202084109010ULL, 0x020008A084040000ULL,
+    0x04246052020A0684ULL, 0x04C0401002008872ULL, 0x1008031002020008ULL, 0x000202A202020000ULL,
+    0x4040402084202002ULL, 0x1000128208110400ULL, 0xCC088010C5082121ULL, 0x80002000008C1C01ULL,
+    0x1401030008A10100ULL, 0x000C240810040820ULL, 0x00200A200C488A00ULL, 0x0210201127102100ULL
+};
+static const uint64_t rook_magics[64] = {
+    0x20800080C0003520ULL, 0x4040400010002000ULL, 0x4100090040102000ULL, 0x4480080180100004ULL,
+    0x0600042010020088ULL, 0x0500040048028100ULL, 0x0400024408010090ULL, 0x2480010004285080ULL,
+    0x0400802040008000ULL, 0x0104400542201004ULL, 0x0000802000100080ULL, 0x2403001001210009ULL,
+    0x0008808088000400ULL, 0x800C808002004400ULL, 0x8004000802100184ULL, 0x0121800480004100ULL,
+    0x0040008000402082ULL, 0x0010104000402002ULL, 0x0020030012C02100ULL, 0x0050008080080010ULL,
+    0x0000050011000800ULL, 0x0206808002000400ULL, 0x01C9440001024870ULL, 0x01000A0000451084ULL,
+    0x2220802080104000ULL, 0x4040100020200800ULL, 0x8060208200120040ULL, 0x2A10008080100800ULL,
+    0x0000040080080080ULL, 0xA000020080800400ULL, 0x0010020080800100ULL, 0x18000C0200014295ULL,
+    0x4020400022800084ULL, 0x2400400088802000ULL, 0x0440801000802000ULL, 0x0000100080800801ULL,
+    0x2004820800800400ULL, 0x4102020080800400ULL, 0x201D800100800200ULL, 0x2000009842000405ULL,
+    0x0020802440048001ULL, 0x0000402010044000ULL, 0x0201002000410010ULL, 0x4826090090030020ULL,
+    0x8058020004004040ULL, 0x0060020004008080ULL, 0x1084040200010100ULL, 0x010288A254020005ULL,
+    0x5A01008002502D00ULL, 0x1040028100403300ULL, 0x4000110020004100ULL, 0x0001001000082100ULL,
+    0x9004800402080080ULL, 0x8800800200040080ULL, 0x0001011802502400ULL, 0x84918081041F4200ULL,
+    0x2068134082010462ULL, 0x08A0400021008011ULL, 0x1222001008402082ULL, 0x0100210118A41001ULL,
+    0x0662009088200402ULL, 0x01010004000A0803ULL, 0x041010010218880CULL, 0x0020004084010022ULL
+};
+
+static inline uint64_t slider_attacks(const magic_t *m, uint64_t occupied)
+{
+#ifdef __BMI2__
+    return m->attacks[_pext_u64(occupied, m->mask)];
+#else
+    return m->attacks[((occupied & m->mask) * m->magic) >> m->shift];
+#endif
+}
+
+#define bishop_attacks(sq, occupied) slider_attacks(&bishop_magic[SQ64(sq)], occupied)
+#define rook_attacks(sq, occupied)   slider_attacks(&rook_magic[SQ64(sq)], occupied)
+
+// Walk the rays from a square, up to the first occupied square
+static uint64_t walk_attacks(int sq, uint64_t occupied, const int *inc)
+{
+    uint64_t attacks = 0;
+    for (int i = 0; i < 4; i++)
+        for (int to = sq + inc[i]; ON_BOARD(to); to += inc[i]) {
+            attacks |= BIT(to);
+            if (occupied & BIT(to)) break;
+        }
+    return attacks;
+}
+
+// Fill the attacks of a square for all the occupancies of its mask. Return the table size
+static int init_magic(magic_t *m, int sq, const int *inc, uint64_t magic, uint64_t *attacks, uint64_t *state)
+{
+    static uint64_t occupancy[4096], reference[4096];
+    static int tried[4096];
+    int i, n = 0, tries = 0;
+
+    m->mask = 0;
+    for (i = 0; i < 4; i++)
+        for (int to = sq + inc[i]; ON_BOARD(to + inc[i]); to += inc[i]) m->mask |= BIT(to);
+    m->shift   = 64 - __builtin_popcountll(m->mask);
+    m->attacks = attacks;
+
+    // All the subsets of the mask
+    uint64_t b = 0;
+    do {
+        occupancy[n]   = b;
+        reference[n++] = walk_attacks(sq, b, inc);
+        b = (b - m->mask) & m->mask;
+    } while (b);
+
+#ifdef __BMI2__
+    (void)magic, (void)state, (void)tries, (void)tried;
+    for (i = 0; i < n; i++) attacks[_pext_u64(occupancy[i], m->mask)] = reference[i];
+#else
+    // Try the given number, then sparse random ones, until one maps the occupancies
+    // without harmful collision
+    memset(tried, 0, sizeof(tried));
+    for (i = 0; i < n;) {
+        if (tries == 0) m->magic = magic;
+        else do m->magic = splitmix64(state) & splitmix64(state) & splitmix64(state);
+        while (__builtin_popcountll((m->mask * m->magic) >> 56) < 6);
+
+        for (tries++, i = 0; i < n; i++) {
+            int index = (occupancy[i] * m->magic) >> m->shift;
+            if (tried[index] < tries) {
+                tried[index]   = tries;
+                attacks[index] = reference[i];
+            }
+            else if (attacks[index] != reference[i]) break;
+        }
+    }
+#endif
+    return n;
+}
+
+static void init_bitboards(void)
+{
+    uint64_t state = 0xFEDCBA0987654321ULL;
+    uint64_t *bishop_ptr = bishop_table, *rook_ptr = rook_table;
+
+    for (int sq = 0; sq < BOARD_SIZE - 2; sq++) {
+        if (!ON_BOARD(sq)) continue;
+        int b = SQ64(sq);
+        for (int i = 0; i < 8; i++) {
+            if (ON_BOARD(sq + knight_inc[i])) knight_attacks[b] |= BIT(sq + knight_inc[i]);
+            if (ON_BOARD(sq + king_inc[i]))   king_attacks[b]   |= BIT(sq + king_inc[i]);
+        }
+        if (ON_BOARD(sq + 9))  pawn_attacks[0][b] |= BIT(sq + 9);
+        if (ON_BOARD(sq + 11)) pawn_attacks[0][b] |= BIT(sq + 11);
+        if (ON_BOARD(sq - 9))  pawn_attacks[1][b] |= BIT(sq - 9);
+        if (ON_BOARD(sq - 11)) pawn_attacks[1][b] |= BIT(sq - 11);
+
+        for (int to = 0; to < BOARD_SIZE - 2; to++) {
+            int inc = ray_inc[BOARD_SIZE + to - sq];
+            if (!ON_BOARD(to) || inc == 0) continue;
+            for (int p = sq + inc; ON_BOARD(p) && p != to; p += inc) between[b][SQ64(to)] |= BIT(p);
+        }
+
+        bishop_ptr += init_magic(&bishop_magic[b], sq, qb_inc, bishop_magics[b], bishop_ptr, &state);
+        rook_ptr   += init_magic(&rook_magic[b], sq, qr_inc, rook_magics[b], rook_ptr, &state);
+    }
+}
+
+// The squares attacked by a piece, but a pawn
+static inline uint64_t piece_attacks(int type, int sq, uint64_t occupied)
+{
+    switch (type) {
+    case KNIGHT: return knight_attacks[SQ64(sq)];
+    case KING:   return king_attacks[SQ64(sq)];
+    case BISHOP: return bishop_attacks(sq, occupied);
+    case ROOK:   return rook_attacks(sq, occupied);
+    default:     return bishop_attacks(sq, occupied) | rook_attacks(sq, occupied);
+    }
+}
+#endif
+
+//------------------------------------------------------------------------------------
+// Evaluation terms and piece lists, updated at each square change
+//------------------------------------------------------------------------------------
+
+// Piece-square tables, built from the bonus and malus tables above
+static int pos_mg_table[STOP + 1][BOARD_SIZE];
+static int pos_eg_table[STOP + 1][BOARD_SIZE];
+
+// The game phase goes from the middle game to the end game as pieces (not pawns) disappear
+#define PHASE_MAX 24
+//                                -  P  P  K  N  B  R  Q
+static const int piece_phase[8] = {0, 0, 0, 0, 1, 1, 2, 4};
+
+static void init_eval_tables(void)
+{
+    for (int sq = 0; sq < BOARD_SIZE; sq++) {
+        for (int type = PAWN; type <= QUEEN; type++) {
+            if (type == KING) {
+                // At the end of the game, the king must avoid the corners
+                pos_eg_table[W_KING][sq] = king_pos_malus[sq];
+                pos_eg_table[B_KING][sq] = -king_pos_malus[sq];
+                continue;
+            }
+            // Center occupation
+            pos_mg_table[BLACK | type][sq] = pos_eg_table[BLACK | type][sq] = black_pos_bonus[sq];
+            pos_mg_table[WHITE | type][sq] = pos_eg_table[WHITE | type][sq] = -white_pos_bonus[sq];
+        }
+        // Encourage pawns to advance to get promotion at end of game
+        pos_eg_table[W_PAWN][sq] -= (sq / 10) << 3;
+        pos_eg_table[B_PAWN][sq] += (7 - (sq / 10)) << 3;
+    }
+}
+
+// Discourage own piece in front of pawn (including double pawn)
+static inline int pawn_front(engine_ctx_t *ctx, int sq)
+{
+    if (B(sq) == B_PAWN && (B(sq - 10) & BLACK)) return -9;
+    if (B(sq) == W_PAWN && (B(sq + 10) & WHITE)) return 9;
+    return 0;
+}
+
+// Change the content of a square, and update the board key, the evaluation terms
+// and the piece lists
+static inline void set_square(engine_ctx_t *ctx, int sq, int piece)
+{
+    eval_t *e    = &ctx->eval[ctx->play];
+    pieces_t *pl = &ctx->pieces[ctx->play];
+    int old      = B(sq);
+
+    // Remove the old piece from its list (the last one of the list takes its place),
+    // then add the new piece at the end of its list
+    if (old & COLORS) {
+        int c = SIDE_INDEX(old & COLORS), i = pl->index[sq], last = pl->sq[c][--pl->nb[c]];
+        pl->sq[c][i]    = last;
+        pl->index[last] = i;
+#ifdef BITBOARDS
+        ctx->bitboards[ctx->play].bb[c][old & TYPE] ^= BIT(sq);
+        ctx->bitboards[ctx->play].bb[c][0]          ^= BIT(sq);
+#endif
+    }
+    if (piece & COLORS) {
+        int c = SIDE_INDEX(piece & COLORS);
+        pl->index[sq]          = pl->nb[c];
+        pl->sq[c][pl->nb[c]++] = sq;
+#ifdef BITBOARDS
+        ctx->bitboards[ctx->play].bb[c][piece & TYPE] ^= BIT(sq);
+        ctx->bitboards[ctx->play].bb[c][0]            ^= BIT(sq);
+#endif
+    }
+
+    ctx->board_hash[ctx->play] ^= zobrist_piece[old][sq] ^ zobrist_piece[piece][sq];
+    e->board_val += piece_value[piece] - piece_value[old];
+    e->nb_pieces += ((piece & COLORS) != 0) - ((old & COLORS) != 0);
+    e->phase     += piece_phase[piece & TYPE] - piece_phase[old & TYPE];
+    e->pos_mg    += pos_mg_table[piece][sq] - pos_mg_table[old][sq];
+    e->pos_eg    += pos_eg_table[piece][sq] - pos_eg_table[old][sq];
+
+    // Only a pawn on the square, or a pawn behind it, is concerned by the pawn front terms
+    if ((old & TYPE) != PAWN && (piece & TYPE) != PAWN && B(sq + 10) != B_PAWN && B(sq - 10) != W_PAWN) {
+        B(sq) = piece;
+        return;
+    }
+    e->pawn_front -= pawn_front(ctx, sq - 10) + pawn_front(ctx, sq) + pawn_front(ctx, sq + 10);
+    B(sq) = piece;
+    e->pawn_front += pawn_front(ctx, sq - 10) + pawn_front(ctx, sq) + pawn_front(ctx, sq + 10);
+}
+
+#ifdef SELF_CHECK
+// Full computation of the evaluation terms, to verify the incremental ones
+static void compute_eval(engine_ctx_t *ctx, eval_t *e)
+{
+    memset(e, 0, sizeof(eval_t));
+    for (int sq = 0; sq < BOARD_SIZE - 2; sq++) {
+        int piece = B(sq);
+        if ((piece & COLORS) == 0) continue;
+        e->board_val  += piece_value[piece];
+        e->nb_pieces  += 1;
+        e->phase      += piece_phase[piece & TYPE];
+        e->pos_mg     += pos_mg_table[piece][sq];
+        e->pos_eg     += pos_eg_table[piece][sq];
+        e->pawn_front += pawn_front(ctx, sq);
+    }
+}
+
+// Verify the piece lists (and the bitboards) against the board
+static int wrong_pieces(engine_ctx_t *ctx)
+{
+    pieces_t *pl = &ctx->pieces[ctx->play];
+    int nb = 0;
+#ifdef BITBOARDS
+    bitboards_t bitboards;
+    memset(&bitboards, 0, sizeof(bitboards));
+#endif
+    for (int sq = 0; sq < BOARD_SIZE - 2; sq++) {
+        if ((B(sq) & COLORS) == 0) continue;
+        int c = SIDE_INDEX(B(sq) & COLORS), i = pl->index[sq];
+        if (i >= pl->nb[c] || pl->sq[c][i] != sq) return 1;
+        nb++;
+#ifdef BITBOARDS
+        bitboards.bb[c][B(sq) & TYPE] |= BIT(sq);
+        bitboards.bb[c][0]            |= BIT(sq);
+#endif
+    }
+#ifdef BITBOARDS
+    if (memcmp(&bitboards, &ctx->bitboards[ctx->play], sizeof(bitboards))) return 1;
+#endif
+    return nb != pl->nb[0] + pl->nb[1];
+}
+#endif
+
 //------------------------------------------------------------------------------------
 // Misc conversion functions
 //------------------------------------------------------------------------------------
 
-static int str_to_move(char *str, move_t *m)
+static int str_to_move(engine_ctx_t *ctx, char *str, move_t *m)
 {
     m->val = 0;
 
@@ -222,10 +757,10 @@ static int str_to_move(char *str, move_t *m)
     return 1;
 }
 
-static char mv_str[8];
-static char *move_str(move_t m)
+// Write the move in the given 8 chars buffer
+static char *move_str(move_t m, char *mv_str)
 {
-    memset(mv_str, 0, sizeof(mv_str));
+    memset(mv_str, 0, 8);
     if (m.val == 0) return "";
     sprintf(mv_str, "%c%c%c%c", 'a' + m.from % 10, '1' + m.from / 10,
             'a' + m.to % 10, '1' + m.to / 10);
@@ -236,84 +771,38 @@ static char *move_str(move_t m)
 
 static char piece_char[33] = " .........PKNBRQ..pknbrq.........";
 
-void set_piece(char ch, int l, int c)
+static void put_piece(engine_ctx_t *ctx, char ch, int l, int c)
 {
     char *ptr = strchr(piece_char, ch);
     if (ptr == NULL) return;
-    char piece = ptr - piece_char;
-
-    int sq = 10 * l + c;
-
-    if ((B(sq) & COLORS) == 0) nb_pieces[play]++;
-
-    board_val[play] -= piece_value[(int)B(sq)];
-    B(sq) = piece;
-    board_val[play] += piece_value[(int)B(sq)];
 
-    if (ch == 'k') king_pos[play | 1] = 10 * l + c;
-    if (ch == 'K') king_pos[(play + 1) & ~1] = 10 * l + c;
-}
+    // A side has at most 16 pieces
+    int piece = ptr - piece_char, side = piece & COLORS;
+    if (side && (B(10 * l + c) & COLORS) != side && ctx->pieces[ctx->play].nb[SIDE_INDEX(side)] == 16) return;
 
-char get_piece(int l, int c)
-{
-    return piece_char[(int)(B(10 * l + c))];
-}
+    set_square(ctx, 10 * l + c, piece);
 
-char *get_move_str(int p)
-{
-    return move_str(moved[p]);
+    if (ch == 'k') ctx->king_pos[ctx->play | 1] = 10 * l + c;
+    if (ch == 'K') ctx->king_pos[(ctx->play + 1) & ~1] = 10 * l + c;
 }
 
-static struct timeval tv0, tv1;
-static long total_ms = 0;
+#define start_chrono(ctx) gettimeofday(&(ctx)->tv0, NULL);
 
-#define start_chrono() gettimeofday(&tv0, NULL);
-
-static long get_chrono(void)
+static long get_chrono(engine_ctx_t *ctx)
 {
+    struct timeval tv1;
     long s, us;
     gettimeofday(&tv1, NULL);
-    s  = tv1.tv_sec - tv0.tv_sec;
-    us = tv1.tv_usec - tv0.tv_usec;
+    s  = tv1.tv_sec - ctx->tv0.tv_sec;
+    us = tv1.tv_usec - ctx->tv0.tv_usec;
     return 1000 * s + us / 1000;
 }
 
-//------------------------------------------------------------------------------------
-// Pengy hash used for the openings book and transposition table
-//------------------------------------------------------------------------------------
-
-static uint64_t pengyhash(const void *p, size_t size, uint32_t seed)
-{
-    uint64_t b[4] = {0};
-    uint64_t s[4] = {0, 0, 0, size};
-    int i;
-
-    for (; size >= 32; size -= 32, p = (const char *)p + 32) {
-        memcpy(b, p, 32);
-
-        s[1] = (s[0] += s[1] + b[3]) + (s[1] << 14 | s[1] >> 50);
-        s[3] = (s[2] += s[3] + b[2]) + (s[3] << 23 | s[3] >> 41);
-        s[3] = (s[0] += s[3] + b[1]) ^ (s[3] << 16 | s[3] >> 48);
-        s[1] = (s[2] += s[1] + b[0]) ^ (s[1] << 40 | s[1] >> 24);
-    }
-
-    memcpy(b, p, size);
-
-    for (i = 0; i < 6; i++) {
-        s[1] = (s[0] += s[1] + b[3]) + (s[1] << 14 | s[1] >> 50) + seed;
-        s[3] = (s[2] += s[3] + b[2]) + (s[3] << 23 | s[3] >> 41);
-        s[3] = (s[0] += s[3] + b[1]) ^ (s[3] << 16 | s[3] >> 48);
-        s[1] = (s[2] += s[1] + b[0]) ^ (s[1] << 40 | s[1] >> 24);
-    }
-
-    return s[0] + s[1] + s[2] + s[3];
-}
-
 //------------------------------------------------------------------------------------
 // Set a board using a FEN string
 //------------------------------------------------------------------------------------
 
-static void FEN_to_board(char *str)
+static void FEN_to_board(engine_ctx_t *ctx, char *str)
 {
     int line = 7, col = 0, fm, wc = 0, bc = 0, ep = 0;
 
@@ -339,23 +828,23 @@ static void FEN_to_board(char *str)
     if (ch >= 'a' && ch <= 'h') {
         ep = ch - 'a';
         ch = *str++;
-        ep += 10 * (ch - '0');
+        ep += 10 * (ch - '1');
     }
     else ep = NO_POSITION;
     str++;
 
     // get the "50 sterile moves" counter
-    for (mv50 = 0; (ch = *str++) != ' '; mv50 = mv50 * 10 + ch - '0') continue;
+    for (ctx->mv50 = 0; (ch = *str++) != ' '; ctx->mv50 = ctx->mv50 * 10 + ch - '0') continue;
 
     // get the "full moves" counter and deduce the ply
     for (fm = 0; (ch = *str++) >= '0'; fm = fm * 10 + ch - '0') continue;
-    play      = 2 * (fm - 1) + (color == 'w') ? 0 : 1;
-    nb_plays  = play;
-    board_ptr = BOARD0 + BOARD_AND_BORDER_SIZE * play;
+    ctx->play = 2 * (fm - 1) + ((color == 'w') ? 0 : 1);
+    if (ctx->play < 0 || ctx->play > MAX_TURNS - 2 * LEVEL_MAX - 8) ctx->play &= 1;  // Keep room for the search
+    ctx->board_ptr = BOARD0(ctx) + BOARD_AND_BORDER_SIZE * ctx->play;
 
     // Now that we know the ply, empty the board ...
     for (line = 0; line < 8; line++)
-        for (col = 0; col < 8; col++) set_piece(' ', line, col);
+        for (col = 0; col < 8; col++) put_piece(ctx, ' ', line, col);
 
     // ... and fill it with the board occupancy information
     line = 7;
@@ -363,181 +852,355 @@ static void FEN_to_board(char *str)
     while ((ch = *str0++) != ' ') {
         if (ch == '/') line--, col = 0;
         else if (ch >= '0' && ch <= '9') col += ch - '0';
-        else set_piece(ch, line, col++);
+        else put_piece(ctx, ch, line, col++);
     }
 
     // Set castles and en passant
-    castles[play]     = (play & 1) ? bc : wc;
-    castles[play + 1] = (play & 1) ? wc : bc;
-    en_passant[play]  = ep;
+    ctx->castles[ctx->play]     = (ctx->play & 1) ? bc : wc;
+    ctx->castles[ctx->play + 1] = (ctx->play & 1) ? wc : bc;
+    ctx->en_passant[ctx->play]  = ep;
+
+    ctx->board_hash[ctx->play] = compute_hash(ctx);
+
+    // List the pieces in the board order, which is also the order the moves are tried
+    pieces_t *pl = &ctx->pieces[ctx->play];
+    pl->nb[0] = pl->nb[1] = 0;
+    for (int sq = 0; sq < BOARD_SIZE - 2; sq++) {
+        if ((B(sq) & COLORS) == 0) continue;
+        int c = SIDE_INDEX(B(sq) & COLORS);
+        pl->index[sq]          = pl->nb[c];
+        pl->sq[c][pl->nb[c]++] = sq;
+    }
+}
+
+//------------------------------------------------------------------------------------
+// Transposition table allocation
+//------------------------------------------------------------------------------------
+
+// Random accesses to a big table miss the TLB all the time: back it with
+// huge pages when the system allows it, otherwise with normal pages.
+static void *alloc_table(size_t size, const char **pages)
+{
+    void *ptr = NULL;
+#ifdef __MINGW32__
+    SIZE_T large_page = GetLargePageMinimum();  // Needs the "Lock pages in memory" privilege
+    if (large_page && size % large_page == 0) {
+        ptr    = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+        *pages = "large";
+    }
+    if (ptr == NULL) {
+        ptr    = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        *pages = "normal";
+    }
+#else
+#ifdef MAP_HUGETLB
+    // Explicit huge pages, if some have been reserved (/proc/sys/vm/nr_hugepages)
+    ptr    = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    *pages = "huge";
+    if (ptr == MAP_FAILED)
+#endif
+    {
+        // Otherwise, ask for transparent huge pages
+        ptr    = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        *pages = "normal";
+#ifdef MADV_HUGEPAGE
+        if (ptr != MAP_FAILED && madvise(ptr, size, MADV_HUGEPAGE) == 0) *pages = "transparent huge";
+#endif
+    }
+    if (ptr == MAP_FAILED) ptr = NULL;
+#endif
+    return ptr;
+}
+
+static void free_table(void *ptr, size_t size)
+{
+#ifdef __MINGW32__
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+// Allocate a new, empty, table of at most 'mb' mega bytes. Return its actual size
+static int init_trans_table(trans_table_t *tt, int mb)
+{
+    const char *pages = "";
+    size_t size = (size_t)1 << 20;
+
+    if (mb < 1) mb = 1;
+    while (2 * size <= ((size_t)mb << 20)) size *= 2;  // Round down to a power of 2
+
+    if (tt->clusters) free_table(tt->clusters, tt->size);
+
+    // If the memory is not available, try again with half of it
+    for (tt->clusters = NULL; tt->clusters == NULL && size >= sizeof(cluster_t); size /= 2)
+        if ((tt->clusters = alloc_table(size, &pages))) break;
+    if (tt->clusters == NULL) {
+        log_info("Could not allocate the transposition table\n");
+        exit(1);
+    }
+    tt->size = size;
+    tt->mask = size / sizeof(cluster_t) - 1;
+
+    log_info_va("Transposition table: %d MB, %s pages\n", (int)(size >> 20), pages);
+    return size >> 20;
+}
+
+static void release_trans_table(trans_table_t *tt)
+{
+    if (tt->clusters) free_table(tt->clusters, tt->size);
+    tt->clusters = NULL;
+}
+
+// The table shared by the games
+int set_table_size(int mb)
+{
+    return init_trans_table(&shared_table, mb);
+}
+
+//------------------------------------------------------------------------------------
+// Late move reductions: how many plies less to search a quiet move, by depth and by
+// rank of the move in the move order (the later, the less likely to cut)
+//------------------------------------------------------------------------------------
+
+static uint8_t reduction[LEVEL_MAX + 1][64];
+
+static void init_reductions(void)
+{
+    for (int depth = 3; depth <= LEVEL_MAX; depth++)
+        for (int n = 3; n < 64; n++) {
+            int r = (int)(0.75 + log(depth) * log(n) / 2.25);
+            reduction[depth][n] = (r < depth - 2) ? r : depth - 2;  // (at least 1 ply left)
+        }
 }
 
 //------------------------------------------------------------------------------------
 // Game init
 //------------------------------------------------------------------------------------
 
-void init_game(char *FEN_string)
+engine_ctx_t *new_engine_ctx(void)
+{
+    // The first context allocates the transposition table shared by all the contexts
+    if (shared_table.clusters == NULL) set_table_size(TABLE_DEFAULT_MB);
+    if (zobrist_side == 0) {
+        init_zobrist();
+        init_eval_tables();
+        init_rays();
+        init_reductions();
+#ifdef BITBOARDS
+        init_bitboards();
+#endif
+    }
+
+    engine_ctx_t *ctx = calloc(1, sizeof(engine_ctx_t));
+    if (ctx == NULL) return NULL;
+    ctx->use_book    = use_book;
+    ctx->verbose     = verbose;
+    ctx->table_epoch = table_generation + 1;
+    ctx->table       = &shared_table;
+    ctx_init_game(ctx, NULL);
+    return ctx;
+}
+
+void free_engine_ctx(engine_ctx_t *ctx)
+{
+    for (int t = 1; t < MAX_THREADS; t++) free(ctx->helper_ctx[t]);
+    free(ctx);
+}
+
+void ctx_init_game(engine_ctx_t *ctx, char *FEN_string)
 {
-    memset(boards, STOP, sizeof(boards));  // Set the boards to all borders
-    memset(table, 0, sizeof(table));       // Reset the transposition table
+    memset(ctx->boards, STOP, sizeof(ctx->boards));  // Set the boards to all borders
+    memset(ctx->eval, 0, sizeof(ctx->eval));
+    memset(ctx->pieces, 0, sizeof(ctx->pieces));
+#ifdef BITBOARDS
+    memset(ctx->bitboards, 0, sizeof(ctx->bitboards));
+#endif
+    memset(ctx->board_hash, 0, sizeof(ctx->board_hash));
+    memset(ctx->moved, 0, sizeof(ctx->moved));  // (no move before the first board)
+    memset(ctx->history, 0, sizeof(ctx->history));
+    memset(ctx->counter_move, 0, sizeof(ctx->counter_move));
+    memset(ctx->cont_history, 0, sizeof(ctx->cont_history));
 
-    if (FEN_string) FEN_to_board(FEN_string);
-    else FEN_to_board("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    if (FEN_string) FEN_to_board(ctx, FEN_string);
+    else {
+        FEN_to_board(ctx, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+        start_hash = ctx->board_hash[ctx->play];
+    }
+    ctx->nb_plays = ctx->play;
+
+    ctx->game_state         = WAIT_GS;
+    ctx->engine_move_str[0] = 0;
+    ctx->time_budget_ms     = 2000;
+    ctx->unused_ms          = 0;
+    ctx->total_ms           = 0;
+    ctx->randomize          = 0;
+    ctx->level_max_max      = LEVEL_MAX;
+    ctx->move_top           = MOVE_STACK(ctx);
+    ctx->root               = ctx;
+}
 
-    game_state     = WAIT_GS;
-    time_budget_ms = 2000;
-    unused_ms      = 0;
-    total_ms       = 0;
-    randomize      = 0;
-    level_max_max  = LEVEL_MAX;
+void ctx_set_time_budget(engine_ctx_t *ctx, long ms)
+{
+    ctx->time_budget_ms = ms;
 }
 
+int   ctx_game_state(engine_ctx_t *ctx)      { return ctx->game_state; }
+char *ctx_engine_move_str(engine_ctx_t *ctx) { return ctx->engine_move_str; }
+int   ctx_play(engine_ctx_t *ctx)            { return ctx->play; }
+
 //------------------------------------------------------------------------------------
 // Make the move, undo it, redo it
 //------------------------------------------------------------------------------------
 
-static void do_move(move_t m)
+static void do_move(engine_ctx_t *ctx, move_t m)
 {
     // Remember the whole previous game to be able to undo the move
-    memcpy(board_ptr + BOARD_AND_BORDER_SIZE, board_ptr, BOARD_SIZE);
-    board_ptr += BOARD_AND_BORDER_SIZE;
+    memcpy(ctx->board_ptr + BOARD_AND_BORDER_SIZE, ctx->board_ptr, BOARD_SIZE);
+    ctx->board_ptr += BOARD_AND_BORDER_SIZE;
 
     int piece = B(m.from);
 
     // if it is a king move, keep track of its position and forbid future castles
-    king_pos[play + 2] = ((piece & TYPE) == KING) ? m.to : king_pos[play];
-    castles[play + 2]  = ((piece & TYPE) == KING) ? 0 : castles[play];
-
-    moved[play] = m;
-    play++;
-    en_passant[play] = NO_POSITION;
-
-    B(m.from) = 0;
-    B(m.to)   = piece;
+    ctx->king_pos[ctx->play + 2] = ((piece & TYPE) == KING) ? m.to : ctx->king_pos[ctx->play];
+    ctx->castles[ctx->play + 2]  = ((piece & TYPE) == KING) ? 0 : ctx->castles[ctx->play];
+
+    ctx->moved[ctx->play] = m;
+    ctx->play++;
+    ctx->en_passant[ctx->play] = NO_POSITION;
+
+    // The board key, the evaluation terms and the piece lists are updated by each square change
+    ctx->board_hash[ctx->play] = ctx->board_hash[ctx->play - 1] ^ zobrist_side;
+    ctx->eval[ctx->play]       = ctx->eval[ctx->play - 1];
+    ctx->pieces[ctx->play]     = ctx->pieces[ctx->play - 1];
+#ifdef BITBOARDS
+    ctx->bitboards[ctx->play]  = ctx->bitboards[ctx->play - 1];
+#endif
 
-    board_val[play] = board_val[play - 1];
-    nb_pieces[play] = nb_pieces[play - 1];
-    if (m.eaten) {
-        board_val[play] -= piece_value[m.eaten];
-        nb_pieces[play]--;
-    }
+    // (the moving piece keeps its place in its list, and so its turn to be tried)
+    set_square(ctx, m.to, piece);
+    set_square(ctx, m.from, 0);
 
     switch (m.special) {
     case WR_CASTLE:
-        B(7) = 0;
-        B(5) = W_ROOK;
+        set_square(ctx, 7, 0);
+        set_square(ctx, 5, W_ROOK);
         break;
     case WL_CASTLE:
-        B(0) = 0;
-        B(3) = W_ROOK;
+        set_square(ctx, 0, 0);
+        set_square(ctx, 3, W_ROOK);
         break;
     case BR_CASTLE:
-        B(77) = 0;
-        B(75) = B_ROOK;
+        set_square(ctx, 77, 0);
+        set_square(ctx, 75, B_ROOK);
         break;
     case BL_CASTLE:
-        B(70) = 0;
-        B(73) = B_ROOK;
+        set_square(ctx, 70, 0);
+        set_square(ctx, 73, B_ROOK);
         break;
     case PROMO_Q:
     case PROMO_N:
-        B(m.to) += m.special;  // Because PROMO_Q = QUEEN - PAWN and PROMO_N = KNIGHT - PAWN
-        board_val[play] -= piece_value[piece];
-        board_val[play] += piece_value[piece | QUEEN];
+        set_square(ctx, m.to, piece + m.special);  // Because PROMO_Q = QUEEN - PAWN and PROMO_N = KNIGHT - PAWN
         break;
     case W_PAWN2:
-        en_passant[play] = m.from + 10;  // notice "en passant" possibility
+        ctx->en_passant[ctx->play] = m.from + 10;  // notice "en passant" possibility
         break;
     case B_PAWN2:
-        en_passant[play] = m.from - 10;  // notice "en passant" possibility
+        ctx->en_passant[ctx->play] = m.from - 10;  // notice "en passant" possibility
         break;
     case EN_PASSANT:  // eat "en passant"
-        if (piece == W_PAWN) B(m.to - 10) = 0;
-        else                 B(m.to + 10) = 0;
-        board_val[play] += piece_value[piece];  // pawn eaten by pawn of opposite color, so...
-        nb_pieces[play]--;
+        set_square(ctx, (piece == W_PAWN) ? m.to - 10 : m.to + 10, 0);
         break;
     case L_ROOK:
-        castles[play + 1] &= ~LEFT_CASTLE;
+        ctx->castles[ctx->play + 1] &= ~LEFT_CASTLE;
         break;
     case R_ROOK:
-        castles[play + 1] &= ~RIGHT_CASTLE;
+        ctx->castles[ctx->play + 1] &= ~RIGHT_CASTLE;
         break;
     }
+
+    // Castle rights of the side that moved, and "en passant" location
+    int p = ctx->play;
+    ctx->board_hash[p] ^= zobrist_castle[(p - 1) & 1][(int)ctx->castles[p - 1]] ^ zobrist_castle[(p - 1) & 1][(int)ctx->castles[p + 1]];
+    ctx->board_hash[p] ^= zobrist_en_passant[(int)ctx->en_passant[p - 1]] ^ zobrist_en_passant[(int)ctx->en_passant[p]];
+}
+
+#ifdef PROFILE
+PROFILED_VOID(do_move, PROF_DO_MOVE, (engine_ctx_t *ctx, move_t m), (ctx, m))
+#define do_move profiled_do_move
+#endif
+
+static inline void undo_move(engine_ctx_t *ctx)
+{
+    ctx->play--;
+    ctx->board_ptr -= BOARD_AND_BORDER_SIZE;
 }
 
-static inline void undo_move(void)
+// Pass the turn (null move): the board does not change, so it is not copied and board_ptr
+// stays. Only the situation of the turn is, without "en passant" possibility.
+static void do_null_move(engine_ctx_t *ctx)
 {
-    play--;
-    board_ptr -= BOARD_AND_BORDER_SIZE;
+    int p = ctx->play;
+    ctx->king_pos[p + 2] = ctx->king_pos[p];
+    ctx->castles[p + 2]  = ctx->castles[p];
+    ctx->moved[p].val    = 0;
+    ctx->play++;
+    ctx->en_passant[p + 1] = NO_POSITION;
+
+    ctx->board_hash[p + 1] = ctx->board_hash[p] ^ zobrist_side ^ zobrist_en_passant[(int)ctx->en_passant[p]];
+    ctx->eval[p + 1]       = ctx->eval[p];
+    ctx->pieces[p + 1]     = ctx->pieces[p];
+#ifdef BITBOARDS
+    ctx->bitboards[p + 1]  = ctx->bitboards[p];
+#endif
 }
 
-void user_undo_move(void)
+static inline void undo_null_move(engine_ctx_t *ctx)
 {
-    if (play) undo_move();
+    ctx->play--;
 }
 
-void user_redo_move(void)
+void ctx_undo_move(engine_ctx_t *ctx)
+{
+    if (ctx->play) undo_move(ctx);
+}
+
+void ctx_redo_move(engine_ctx_t *ctx)
 {
-    if (play >= nb_plays) return;
-    play++;
-    board_ptr += BOARD_AND_BORDER_SIZE;
+    if (ctx->play >= ctx->nb_plays) return;
+    ctx->play++;
+    ctx->board_ptr += BOARD_AND_BORDER_SIZE;
 }
 
 //------------------------------------------------------------------------------------
 // Test if the king is in check
 //------------------------------------------------------------------------------------
 
-static const int qb_inc[4] = {9, 11, -9, -11};
-static const int qr_inc[4] = {10, 1, -10, -1};
-
-static int list_king_protectors(int side, int *king_protectors)
+#ifdef BITBOARDS
+static int in_check(engine_ctx_t *ctx, int side, int pos)
+{
+    uint64_t (*bb)[8] = ctx->bitboards[ctx->play].bb;
+    int other = SIDE_INDEX(side) ^ 1, b = SQ64(pos);
+    uint64_t occupied = bb[0][0] | bb[1][0];
+
+    return (pawn_attacks[SIDE_INDEX(side)][b] & bb[other][PAWN]) ||
+           (knight_attacks[b] & bb[other][KNIGHT]) ||
+           (king_attacks[b] & bb[other][KING]) ||
+           (bishop_attacks(pos, occupied) & (bb[other][BISHOP] | bb[other][QUEEN])) ||
+           (rook_attacks(pos, occupied) & (bb[other][ROOK] | bb[other][QUEEN]));
+}
+#else
+static int in_check(engine_ctx_t *ctx, int side, int pos)
 {
-    int other = side ^ COLORS;
-    int i, inc, p, k_pos = king_pos[play];
     char type;
+    int p;
+    int fwd   = (side == WHITE) ? 10 : -10;
+    int other = COLORS ^ side;
 
-    // The king does not protect him-self, but like the king protectors,
-    // if it moves, its check state must be completely re-evaluated
-    king_protectors[0]     = k_pos;
-    int king_protectors_nb = 1;
-
-    // test queen and bishop
-    for (i = 0; i < 4; i++) {
-        inc = qb_inc[i];
-        for (p = k_pos + inc; B(p) == 0; p += inc) continue;
-        if ((B(p) & COLORS) == side) {
-            king_protectors[king_protectors_nb] = p;
-            for (p += inc; B(p) == 0; p += inc) continue;
-            type = B(p) ^ other;
-            if (type == QUEEN || type == BISHOP) king_protectors_nb++;
-        }
-    }
-
-    // test queen and rook
-    for (i = 0; i < 4; i++) {
-        inc = qr_inc[i];
-        for (p = k_pos + inc; B(p) == 0; p += inc) continue;
-        if ((B(p) & COLORS) == side) {
-            king_protectors[king_protectors_nb] = p;
-            for (p += inc; B(p) == 0; p += inc) continue;
-            type = B(p) ^ other;
-            if (type == QUEEN || type == ROOK) king_protectors_nb++;
-        }
-    }
-    return king_protectors_nb;
-}
-
-static int in_check(int side, int pos)
-{
-    char type;
-    int p;
-    int fwd   = (side == WHITE) ? 10 : -10;
-    int other = COLORS ^ side;
-
-    // test pawn and king closeby
-    if ((B(pos + fwd - 1) ^ other) <= KING) return 1;
-    if ((B(pos + fwd + 1) ^ other) <= KING) return 1;
+    // test pawn and king closeby
+    if ((B(pos + fwd - 1) ^ other) <= KING) return 1;
+    if ((B(pos + fwd + 1) ^ other) <= KING) return 1;
 
     // king closeby
     if ((B(pos - fwd + 1) ^ other) == KING) return 1;
@@ -594,204 +1257,536 @@ static int in_check(int side, int pos)
     return 0;
 }
 
+#endif
+
+#ifdef PROFILE
+PROFILED(int, in_check, PROF_IN_CHECK, (engine_ctx_t *ctx, int side, int pos), (ctx, side, pos))
+#define in_check profiled_in_check
+#endif
+
+//------------------------------------------------------------------------------------
+// Static Exchange Evaluation: material won by the sequence of captures on a square
+//------------------------------------------------------------------------------------
+
+// Position of the least valuable piece of 'side' attacking 'pos', or -1 if none.
+// Like in_check(), follow the rays: pieces removed from the board reveal x-rays
+static int least_valuable_attacker(engine_ctx_t *ctx, int side, int pos)
+{
+    int i, p, queen = -1;
+    int back = (side == WHITE) ? -10 : 10;
+
+    if (B(pos + back - 1) == (side | PAWN)) return pos + back - 1;
+    if (B(pos + back + 1) == (side | PAWN)) return pos + back + 1;
+
+    for (i = 0; i < 8; i++)
+        if (B(pos + knight_inc[i]) == (side | KNIGHT)) return pos + knight_inc[i];
+
+    for (i = 0; i < 4; i++) {
+        for (p = pos + qb_inc[i]; B(p) == 0; p += qb_inc[i]) continue;
+        if (B(p) == (side | BISHOP)) return p;
+        if (B(p) == (side | QUEEN)) queen = p;
+    }
+    for (i = 0; i < 4; i++) {
+        for (p = pos + qr_inc[i]; B(p) == 0; p += qr_inc[i]) continue;
+        if (B(p) == (side | ROOK)) return p;
+        if (B(p) == (side | QUEEN)) queen = p;
+    }
+    if (queen >= 0) return queen;
+
+    for (i = 0; i < 8; i++)
+        if (B(pos + king_inc[i]) == (side | KING)) return pos + king_inc[i];
+    return -1;
+}
+
+#define abs_value(piece) piece_value[BLACK | ((piece) & TYPE)]
+
+static int see(engine_ctx_t *ctx, move_t m)
+{
+    int gain[32], removed[32], nb_removed = 1, d = 0, sq;
+    char saved[32];
+    int side      = B(m.from) & COLORS;
+    int on_square = abs_value(B(m.from));  // Value of the piece that would be eaten next
+
+    // Each side in turn recaptures with its least valuable piece, removed from the board
+    gain[0]    = abs_value(m.eaten);
+    removed[0] = m.from;
+    saved[0]   = B(m.from);
+    B(m.from)  = 0;
+
+    for (side ^= COLORS; (sq = least_valuable_attacker(ctx, side, m.to)) >= 0; side ^= COLORS) {
+        d++;
+        gain[d] = on_square - gain[d - 1];
+        if (-gain[d - 1] < 0 && gain[d] < 0) break;  // Bad for the side to play, whatever comes next
+
+        on_square           = abs_value(B(sq));
+        removed[nb_removed] = sq;
+        saved[nb_removed++] = B(sq);
+        B(sq)               = 0;
+    }
+
+    // Put the pieces back
+    while (nb_removed--) B(removed[nb_removed]) = saved[nb_removed];
+
+    // Each side may stop the exchanges when it is worth it
+    for (; d > 0; d--)
+        gain[d - 1] = (-gain[d - 1] > gain[d]) ? gain[d - 1] : -gain[d];
+    return gain[0];
+}
+
+// Only a capture by a more valuable piece can lose material
+static inline int losing_capture(engine_ctx_t *ctx, move_t m)
+{
+    return m.eaten && abs_value(B(m.from)) > abs_value(m.eaten) && see(ctx, m) < 0;
+}
+
 //------------------------------------------------------------------------------------
 // List possible moves
 //------------------------------------------------------------------------------------
 
-static void add_move(int from, int to, int special)
+static void add_move(engine_ctx_t *ctx, int from, int to, int special)
 {
-    move_ptr->from    = from;
-    move_ptr->to      = to;
-    move_ptr->eaten   = B(to);
-    move_ptr->special = special;
-    move_ptr++;
+    ctx->move_ptr->from    = from;
+    ctx->move_ptr->to      = to;
+    ctx->move_ptr->eaten   = B(to);
+    ctx->move_ptr->special = special;
+    ctx->move_ptr++;
 }
 
-static int check_move(char blocking, int from, int to)
+static int check_move(engine_ctx_t *ctx, char blocking, int from, int to)
 {
     if (B(to) & blocking) return 0;
-    add_move(from, to, 0);
+    add_move(ctx, from, to, 0);
     return (B(to) == 0);
 }
 
-static void check_crawler_move(char blocking, int from, int to)
+static void check_crawler_move(engine_ctx_t *ctx, char blocking, int from, int to)
 {
-    if ((B(to) & blocking) == 0) add_move(from, to, 0);
+    if ((B(to) & blocking) == 0) add_move(ctx, from, to, 0);
 }
 
-static int check_rook_move(char blocking, int from, int to)
+// Moving a rook from its corner forbids the castle on its side
+static inline int rook_special(int from)
 {
-    int special = 0;
-    if (from == 0 || from == 70) special = L_ROOK;
-    if (from == 7 || from == 77) special = R_ROOK;
+    if (from == 0 || from == 70) return L_ROOK;
+    if (from == 7 || from == 77) return R_ROOK;
+    return 0;
+}
 
+static int check_rook_move(engine_ctx_t *ctx, char blocking, int from, int to)
+{
     if (B(to) & blocking) return 0;
-    add_move(from, to, special);
+    add_move(ctx, from, to, rook_special(from));
     return (B(to) == 0);
 }
 
-static int check_pawn_move(int from, int to)
+#ifdef BITBOARDS
+static void add_moves(engine_ctx_t *ctx, int from, uint64_t targets, int special)
+{
+    for (; targets; targets &= targets - 1) add_move(ctx, from, SQ10(__builtin_ctzll(targets)), special);
+}
+#endif
+
+static int check_pawn_move(engine_ctx_t *ctx, int from, int to)
 {
     if (B(to)) return 0;
     if (to < 8 || to >= 70) {
-        add_move(from, to, PROMO_Q);
-        add_move(from, to, PROMO_N);
+        add_move(ctx, from, to, PROMO_Q);
+        add_move(ctx, from, to, PROMO_N);
     }
-    else add_move(from, to, 0);
+    else add_move(ctx, from, to, 0);
     return 1;
 }
 
-static void check_pawn_move2(int from, int to, int special)
+static void check_pawn_move2(engine_ctx_t *ctx, int from, int to, int special)
 {
-    if (B(to) == 0) add_move(from, to, special);
+    if (B(to) == 0) add_move(ctx, from, to, special);
 }
 
-static void check_wpawn_eat(int from, int to)
+static void check_wpawn_eat(engine_ctx_t *ctx, int from, int to)
 {
     if (B(to) & BLACK) {
         if (to >= 70) {
-            add_move(from, to, PROMO_Q);
-            add_move(from, to, PROMO_N);
+            add_move(ctx, from, to, PROMO_Q);
+            add_move(ctx, from, to, PROMO_N);
         }
-        else add_move(from, to, 0);
+        else add_move(ctx, from, to, 0);
     }
-    else if (en_passant[play] == to)
-        add_move(from, to, EN_PASSANT);
+    else if (ctx->en_passant[ctx->play] == to)
+        add_move(ctx, from, to, EN_PASSANT);
 }
 
-static void check_bpawn_eat(int from, int to)
+static void check_bpawn_eat(engine_ctx_t *ctx, int from, int to)
 {
     if (B(to) & WHITE) {
         if (to < 8) {
-            add_move(from, to, PROMO_Q);
-            add_move(from, to, PROMO_N);
+            add_move(ctx, from, to, PROMO_Q);
+            add_move(ctx, from, to, PROMO_N);
         }
-        else add_move(from, to, 0);
+        else add_move(ctx, from, to, 0);
     }
-    else if (en_passant[play] == to)
-        add_move(from, to, EN_PASSANT);
+    else if (ctx->en_passant[ctx->play] == to)
+        add_move(ctx, from, to, EN_PASSANT);
 }
 
-static void list_moves(int pos)
+static void list_moves(engine_ctx_t *ctx, int pos)
 {
     int i;
     char piece    = B(pos);
     char blocking = (B(pos) & COLORS) + STOP;
 
+#ifdef BITBOARDS
+    // The moves of the pieces, but the pawns, are the squares they attack (the king may castle too)
+    if ((piece & COLORS) && (piece & TYPE) != PAWN) {
+        uint64_t (*bb)[8] = ctx->bitboards[ctx->play].bb;
+        uint64_t targets  = piece_attacks(piece & TYPE, pos, bb[0][0] | bb[1][0]) & ~bb[SIDE_INDEX(piece & COLORS)][0];
+        add_moves(ctx, pos, targets, ((piece & TYPE) == ROOK) ? rook_special(pos) : 0);
+        if ((piece & TYPE) != KING) return;
+    }
+#endif
+
     switch (piece) {
     case W_KING:
-        check_crawler_move(WHITE + STOP, pos, pos - 11);
-        check_crawler_move(WHITE + STOP, pos, pos - 10);
-        check_crawler_move(WHITE + STOP, pos, pos - 9);
-        check_crawler_move(WHITE + STOP, pos, pos + 9);
-        check_crawler_move(WHITE + STOP, pos, pos + 10);
-        check_crawler_move(WHITE + STOP, pos, pos + 11);
-        check_crawler_move(WHITE + STOP, pos, pos - 1);
-        check_crawler_move(WHITE + STOP, pos, pos + 1);
+#ifndef BITBOARDS
+        check_crawler_move(ctx, WHITE + STOP, pos, pos - 11);
+        check_crawler_move(ctx, WHITE + STOP, pos, pos - 10);
+        check_crawler_move(ctx, WHITE + STOP, pos, pos - 9);
+        check_crawler_move(ctx, WHITE + STOP, pos, pos + 9);
+        check_crawler_move(ctx, WHITE + STOP, pos, pos + 10);
+        check_crawler_move(ctx, WHITE + STOP, pos, pos + 11);
+        check_crawler_move(ctx, WHITE + STOP, pos, pos - 1);
+        check_crawler_move(ctx, WHITE + STOP, pos, pos + 1);
+#endif
 
         // white castles
         if (pos == 4) {
-            if (B(5) == 0 && B(6) == 0 && B(7) == W_ROOK && (castles[play] & RIGHT_CASTLE) && !in_check(WHITE, 4) && !in_check(WHITE, 5) && !in_check(WHITE, 6))
-                add_move(pos, 6, WR_CASTLE);
-            if (B(3) == 0 && B(2) == 0 && B(1) == 0 && B(0) == W_ROOK && (castles[play] & LEFT_CASTLE) && !in_check(WHITE, 4) && !in_check(WHITE, 3) && !in_check(WHITE, 2))
-                add_move(pos, 2, WL_CASTLE);
+            if (B(5) == 0 && B(6) == 0 && B(7) == W_ROOK && (ctx->castles[ctx->play] & RIGHT_CASTLE) && !in_check(ctx, WHITE, 4) && !in_check(ctx, WHITE, 5) && !in_check(ctx, WHITE, 6))
+                add_move(ctx, pos, 6, WR_CASTLE);
+            if (B(3) == 0 && B(2) == 0 && B(1) == 0 && B(0) == W_ROOK && (ctx->castles[ctx->play] & LEFT_CASTLE) && !in_check(ctx, WHITE, 4) && !in_check(ctx, WHITE, 3) && !in_check(ctx, WHITE, 2))
+                add_move(ctx, pos, 2, WL_CASTLE);
         }
         break;
     case B_KING:
-        check_crawler_move(BLACK + STOP, pos, pos - 11);
-        check_crawler_move(BLACK + STOP, pos, pos - 10);
-        check_crawler_move(BLACK + STOP, pos, pos - 9);
-        check_crawler_move(BLACK + STOP, pos, pos + 9);
-        check_crawler_move(BLACK + STOP, pos, pos + 10);
-        check_crawler_move(BLACK + STOP, pos, pos + 11);
-        check_crawler_move(BLACK + STOP, pos, pos - 1);
-        check_crawler_move(BLACK + STOP, pos, pos + 1);
+#ifndef BITBOARDS
+        check_crawler_move(ctx, BLACK + STOP, pos, pos - 11);
+        check_crawler_move(ctx, BLACK + STOP, pos, pos - 10);
+        check_crawler_move(ctx, BLACK + STOP, pos, pos - 9);
+        check_crawler_move(ctx, BLACK + STOP, pos, pos + 9);
+        check_crawler_move(ctx, BLACK + STOP, pos, pos + 10);
+        check_crawler_move(ctx, BLACK + STOP, pos, pos + 11);
+        check_crawler_move(ctx, BLACK + STOP, pos, pos - 1);
+        check_crawler_move(ctx, BLACK + STOP, pos, pos + 1);
+#endif
 
         // black castles
         if (pos == 74) {
-            if (B(75) == 0 && B(76) == 0 && B(77) == B_ROOK && (castles[play] & RIGHT_CASTLE) && !in_check(BLACK, 74) && !in_check(BLACK, 75) && !in_check(BLACK, 76))
-                add_move(pos, 76, BR_CASTLE);
-            if (B(73) == 0 && B(72) == 0 && B(71) == 0 && B(70) == B_ROOK && (castles[play] & LEFT_CASTLE) && !in_check(BLACK, 74) && !in_check(BLACK, 73) && !in_check(BLACK, 72))
-                add_move(pos, 72, BL_CASTLE);
+            if (B(75) == 0 && B(76) == 0 && B(77) == B_ROOK && (ctx->castles[ctx->play] & RIGHT_CASTLE) && !in_check(ctx, BLACK, 74) && !in_check(ctx, BLACK, 75) && !in_check(ctx, BLACK, 76))
+                add_move(ctx, pos, 76, BR_CASTLE);
+            if (B(73) == 0 && B(72) == 0 && B(71) == 0 && B(70) == B_ROOK && (ctx->castles[ctx->play] & LEFT_CASTLE) && !in_check(ctx, BLACK, 74) && !in_check(ctx, BLACK, 73) && !in_check(ctx, BLACK, 72))
+                add_move(ctx, pos, 72, BL_CASTLE);
         }
         break;
     case W_QUEEN:
     case B_QUEEN:
-        for (i = 1; check_move(blocking, pos, pos - i); i++) continue;
-        for (i = 1; check_move(blocking, pos, pos + i); i++) continue;
-        for (i = 10; check_move(blocking, pos, pos - i); i += 10) continue;
-        for (i = 10; check_move(blocking, pos, pos + i); i += 10) continue;
+        for (i = 1; check_move(ctx, blocking, pos, pos - i); i++) continue;
+        for (i = 1; check_move(ctx, blocking, pos, pos + i); i++) continue;
+        for (i = 10; check_move(ctx, blocking, pos, pos - i); i += 10) continue;
+        for (i = 10; check_move(ctx, blocking, pos, pos + i); i += 10) continue;
     case W_BISHOP:
     case B_BISHOP:
-        for (i = 9; check_move(blocking, pos, pos - i); i += 9) continue;
-        for (i = 9; check_move(blocking, pos, pos + i); i += 9) continue;
-        for (i = 11; check_move(blocking, pos, pos - i); i += 11) continue;
-        for (i = 11; check_move(blocking, pos, pos + i); i += 11) continue;
+        for (i = 9; check_move(ctx, blocking, pos, pos - i); i += 9) continue;
+        for (i = 9; check_move(ctx, blocking, pos, pos + i); i += 9) continue;
+        for (i = 11; check_move(ctx, blocking, pos, pos - i); i += 11) continue;
+        for (i = 11; check_move(ctx, blocking, pos, pos + i); i += 11) continue;
         break;
     case W_KNIGHT:
     case B_KNIGHT:
-        check_crawler_move(blocking, pos, pos + 12);
-        check_crawler_move(blocking, pos, pos + 8);
-        check_crawler_move(blocking, pos, pos - 12);
-        check_crawler_move(blocking, pos, pos - 8);
-        check_crawler_move(blocking, pos, pos + 21);
-        check_crawler_move(blocking, pos, pos + 19);
-        check_crawler_move(blocking, pos, pos - 21);
-        check_crawler_move(blocking, pos, pos - 19);
+        check_crawler_move(ctx, blocking, pos, pos + 12);
+        check_crawler_move(ctx, blocking, pos, pos + 8);
+        check_crawler_move(ctx, blocking, pos, pos - 12);
+        check_crawler_move(ctx, blocking, pos, pos - 8);
+        check_crawler_move(ctx, blocking, pos, pos + 21);
+        check_crawler_move(ctx, blocking, pos, pos + 19);
+        check_crawler_move(ctx, blocking, pos, pos - 21);
+        check_crawler_move(ctx, blocking, pos, pos - 19);
         break;
 
     case W_ROOK:
     case B_ROOK:
-        for (i = 1; check_rook_move(blocking, pos, pos - i); i++) continue;
-        for (i = 1; check_rook_move(blocking, pos, pos + i); i++) continue;
-        for (i = 10; check_rook_move(blocking, pos, pos - i); i += 10) continue;
-        for (i = 10; check_rook_move(blocking, pos, pos + i); i += 10) continue;
+        for (i = 1; check_rook_move(ctx, blocking, pos, pos - i); i++) continue;
+        for (i = 1; check_rook_move(ctx, blocking, pos, pos + i); i++) continue;
+        for (i = 10; check_rook_move(ctx, blocking, pos, pos - i); i += 10) continue;
+        for (i = 10; check_rook_move(ctx, blocking, pos, pos + i); i += 10) continue;
         break;
 
     case W_PAWN:
-        if (check_pawn_move(pos, pos + 10) && pos < 20)
-            check_pawn_move2(pos, pos + 20, W_PAWN2);
-        check_wpawn_eat(pos, pos + 9);
-        check_wpawn_eat(pos, pos + 11);
+        if (check_pawn_move(ctx, pos, pos + 10) && pos < 20)
+            check_pawn_move2(ctx, pos, pos + 20, W_PAWN2);
+        check_wpawn_eat(ctx, pos, pos + 9);
+        check_wpawn_eat(ctx, pos, pos + 11);
         break;
     case B_PAWN:
-        if (check_pawn_move(pos, pos - 10) && pos >= 60)
-            check_pawn_move2(pos, pos - 20, B_PAWN2);
-        check_bpawn_eat(pos, pos - 9);
-        check_bpawn_eat(pos, pos - 11);
+        if (check_pawn_move(ctx, pos, pos - 10) && pos >= 60)
+            check_pawn_move2(ctx, pos, pos - 20, B_PAWN2);
+        check_bpawn_eat(ctx, pos, pos - 9);
+        check_bpawn_eat(ctx, pos, pos - 11);
         break;
     }
 }
 
+#ifdef PROFILE
+PROFILED_VOID(list_moves, PROF_LIST_MOVES, (engine_ctx_t *ctx, int pos), (ctx, pos))
+#define list_moves profiled_list_moves
+#endif
+
+// Only list the captures and the promotions to a queen (for the quiescence search)
+static void list_captures(engine_ctx_t *ctx, int pos)
+{
+    int i, to;
+    char piece = B(pos);
+    char other = (piece & COLORS) ^ COLORS;
+
+#ifdef BITBOARDS
+    if ((piece & COLORS) && (piece & TYPE) != PAWN) {
+        uint64_t (*bb)[8] = ctx->bitboards[ctx->play].bb;
+        uint64_t targets  = piece_attacks(piece & TYPE, pos, bb[0][0] | bb[1][0]) & bb[SIDE_INDEX(other)][0];
+        add_moves(ctx, pos, targets, ((piece & TYPE) == ROOK) ? rook_special(pos) : 0);
+        return;
+    }
+#endif
+
+    switch (piece) {
+    case W_KING:
+    case B_KING:
+        for (i = 0; i < 8; i++)
+            if (B(pos + king_inc[i]) & other) add_move(ctx, pos, pos + king_inc[i], 0);
+        break;
+    case W_QUEEN:
+    case B_QUEEN:
+        for (i = 0; i < 4; i++) {
+            for (to = pos + qr_inc[i]; B(to) == 0; to += qr_inc[i]) continue;
+            if (B(to) & other) add_move(ctx, pos, to, 0);
+        }
+    case W_BISHOP:
+    case B_BISHOP:
+        for (i = 0; i < 4; i++) {
+            for (to = pos + qb_inc[i]; B(to) == 0; to += qb_inc[i]) continue;
+            if (B(to) & other) add_move(ctx, pos, to, 0);
+        }
+        break;
+    case W_KNIGHT:
+    case B_KNIGHT:
+        for (i = 0; i < 8; i++)
+            if (B(pos + knight_inc[i]) & other) add_move(ctx, pos, pos + knight_inc[i], 0);
+        break;
+    case W_ROOK:
+    case B_ROOK:
+        for (i = 0; i < 4; i++) {
+            for (to = pos + qr_inc[i]; B(to) == 0; to += qr_inc[i]) continue;
+            if (B(to) & other) check_rook_move(ctx, STOP, pos, to);
+        }
+        break;
+    case W_PAWN:
+        if (pos >= 60 && B(pos + 10) == 0) add_move(ctx, pos, pos + 10, PROMO_Q);
+        check_wpawn_eat(ctx, pos, pos + 9);
+        check_wpawn_eat(ctx, pos, pos + 11);
+        break;
+    case B_PAWN:
+        if (pos < 20 && B(pos - 10) == 0) add_move(ctx, pos, pos - 10, PROMO_Q);
+        check_bpawn_eat(ctx, pos, pos - 9);
+        check_bpawn_eat(ctx, pos, pos - 11);
+        break;
+    }
+}
+
+//------------------------------------------------------------------------------------
+// Legal moves: the pieces giving check and the pinned pieces are found once per board,
+// then a pseudo-legal move is legal if it does not break a pin and if it stops the check
+//------------------------------------------------------------------------------------
+
+typedef struct {
+    int k_pos;
+    int nb_checkers;
+    int checker, check_inc;  // A piece giving check, and its direction from the king (0 for a knight)
+    int nb_pins;
+    int pinned[8], pin_inc[8];  // The pinned pieces, and the direction of their pin from the king
+} legality_t;
+
+#ifdef BITBOARDS
+static void list_pins_and_checks(engine_ctx_t *ctx, int side, legality_t *lg)
+{
+    uint64_t (*bb)[8] = ctx->bitboards[ctx->play].bb;
+    int own = SIDE_INDEX(side), other = own ^ 1, k_pos = ctx->king_pos[ctx->play];
+    uint64_t occupied = bb[0][0] | bb[1][0];
+
+    lg->k_pos   = k_pos;
+    lg->nb_pins = 0;
+
+    uint64_t checkers = (pawn_attacks[own][SQ64(k_pos)] & bb[other][PAWN]) |
+                        (knight_attacks[SQ64(k_pos)] & bb[other][KNIGHT]);
+
+    // The queens, rooks and bishops that would attack the king on an empty board give check
+    // if nothing is between them, or pin the piece between them if it is the only one
+    uint64_t snipers = (bishop_attacks(k_pos, 0) & (bb[other][BISHOP] | bb[other][QUEEN])) |
+                       (rook_attacks(k_pos, 0) & (bb[other][ROOK] | bb[other][QUEEN]));
+    for (; snipers; snipers &= snipers - 1) {
+        int sniper = __builtin_ctzll(snipers);
+        uint64_t b = between[SQ64(k_pos)][sniper] & occupied;
+        if (b == 0) checkers |= 1ULL << sniper;
+        else if ((b & (b - 1)) == 0 && (b & bb[own][0])) {
+            lg->pinned[lg->nb_pins]    = SQ10(__builtin_ctzll(b));
+            lg->pin_inc[lg->nb_pins++] = ray_inc[BOARD_SIZE + SQ10(sniper) - k_pos];
+        }
+    }
+
+    lg->nb_checkers = __builtin_popcountll(checkers);
+    if (checkers) {
+        lg->checker   = SQ10(__builtin_ctzll(checkers));
+        lg->check_inc = ray_inc[BOARD_SIZE + lg->checker - k_pos];
+    }
+}
+#else
+static void list_pins_and_checks(engine_ctx_t *ctx, int side, legality_t *lg)
+{
+    int other    = side ^ COLORS;
+    pieces_t *pl = &ctx->pieces[ctx->play];
+    int i, inc, p, pos, k_pos = ctx->king_pos[ctx->play];
+    int fwd = (side == WHITE) ? 10 : -10;
+    char type;
+
+    lg->k_pos       = k_pos;
+    lg->nb_checkers = 0;
+    lg->nb_pins     = 0;
+
+    // Pawns and knights
+    if (B(k_pos + fwd - 1) == (other | PAWN)) lg->checker = k_pos + fwd - 1, lg->nb_checkers++;
+    if (B(k_pos + fwd + 1) == (other | PAWN)) lg->checker = k_pos + fwd + 1, lg->nb_checkers++;
+    for (i = 0; i < 8; i++)
+        if (B(k_pos + knight_inc[i]) == (other | KNIGHT)) lg->checker = k_pos + knight_inc[i], lg->nb_checkers++;
+    lg->check_inc = 0;
+
+    // The queens, rooks and bishops aligned with the king give check if nothing is
+    // between them, or pin the piece between them if it is the only one
+    for (i = 0; i < pl->nb[SIDE_INDEX(other)]; i++) {
+        pos  = pl->sq[SIDE_INDEX(other)][i];
+        type = B(pos) & TYPE;
+        inc  = ray_inc[BOARD_SIZE + pos - k_pos];
+        if (inc == 0 || (type != QUEEN && type != ray_piece[BOARD_SIZE + pos - k_pos])) continue;
+
+        for (p = k_pos + inc; B(p) == 0; p += inc) continue;
+        if (p == pos) {
+            lg->checker   = pos;
+            lg->check_inc = inc;
+            lg->nb_checkers++;
+        }
+        else if ((B(p) & COLORS) == side) {
+            lg->pinned[lg->nb_pins] = p;
+            for (p += inc; B(p) == 0; p += inc) continue;
+            if (p == pos) lg->pin_inc[lg->nb_pins++] = inc;
+        }
+    }
+}
+#endif
+
+#ifdef PROFILE
+PROFILED_VOID(list_pins_and_checks, PROF_PINS_AND_CHECKS, (engine_ctx_t *ctx, int side, legality_t *lg), (ctx, side, lg))
+#define list_pins_and_checks profiled_list_pins_and_checks
+#endif
+
+// The squares where a piece stops a single check: the checker's, and the ones in between
+static inline int stops_check(legality_t *lg, int to)
+{
+    int inc = lg->check_inc;
+    if (to == lg->checker) return 1;
+    return inc && ray_inc[BOARD_SIZE + to - lg->k_pos] == inc && (to - lg->k_pos) / inc < (lg->checker - lg->k_pos) / inc;
+}
+
+static int is_legal(engine_ctx_t *ctx, legality_t *lg, move_t m)
+{
+    int i, side = B(m.from) & COLORS, legal;
+
+    // The king must not go to an attacked square (the castles are verified when listed)
+    if (m.from == lg->k_pos) {
+        if (m.special >= BR_CASTLE && m.special <= WL_CASTLE) return 1;
+        B(m.from) = 0;  // (the king does not protect the squares behind him)
+#ifdef BITBOARDS
+        ctx->bitboards[ctx->play].bb[SIDE_INDEX(side)][0] ^= BIT(m.from);
+#endif
+        legal = !in_check(ctx, side, m.to);
+#ifdef BITBOARDS
+        ctx->bitboards[ctx->play].bb[SIDE_INDEX(side)][0] ^= BIT(m.from);
+#endif
+        B(m.from) = side | KING;
+        return legal;
+    }
+    if (lg->nb_checkers > 1) return 0;
+
+    // Eating "en passant" removes two pieces from a line: simply try it
+    if (m.special == EN_PASSANT) {
+        do_move(ctx, m);
+        legal = !in_check(ctx, side, ctx->king_pos[ctx->play + 1]);
+        undo_move(ctx);
+        return legal;
+    }
+
+    if (lg->nb_checkers && !stops_check(lg, m.to)) return 0;
+
+    // A pinned piece may only move along its pin
+    for (i = 0; i < lg->nb_pins; i++)
+        if (m.from == lg->pinned[i]) return ray_inc[BOARD_SIZE + m.to - lg->k_pos] == lg->pin_inc[i];
+    return 1;
+}
+
+#ifdef PROFILE
+PROFILED(int, is_legal, PROF_IS_LEGAL, (engine_ctx_t *ctx, legality_t *lg, move_t m), (ctx, lg, m))
+#define is_legal profiled_is_legal
+#endif
+
+// In check, list the moves of the king and, if there is a single checker, the moves
+// that eat it or come in between. Not all of them are legal yet (pins, attacked squares)
+static void list_evasions(engine_ctx_t *ctx, int side, legality_t *lg)
+{
+    pieces_t *pl = &ctx->pieces[ctx->play];
+    move_t *m, *q;
+
+    list_moves(ctx, lg->k_pos);
+    if (lg->nb_checkers > 1) return;
+
+    for (int i = 0; i < pl->nb[SIDE_INDEX(side)]; i++) {
+        if (pl->sq[SIDE_INDEX(side)][i] == lg->k_pos) continue;
+        m = q = ctx->move_ptr;
+        list_moves(ctx, pl->sq[SIDE_INDEX(side)][i]);
+        for (; m < ctx->move_ptr; m++)
+            if (stops_check(lg, m->to) || m->special == EN_PASSANT) *q++ = *m;
+        ctx->move_ptr = q;
+    }
+}
+
 //------------------------------------------------------------------------------------
 // Test both check and check & mat
 //------------------------------------------------------------------------------------
 
-static int in_mat(int side)
+static int in_mat(engine_ctx_t *ctx, int side, legality_t *lg)
 {
-    int from, check;
     move_t list_of_moves[256];
-    move_t *m;
+    move_t *m, *end;
 
-    // List all possible moves
-    move_ptr = list_of_moves;
-    for (from = 0; from < BOARD_SIZE; from++)
-        if (B(from) & side) list_moves(from);
+    // List the moves that may escape the check, and look for a legal one
+    ctx->move_ptr = list_of_moves;
+    list_evasions(ctx, side, lg);
+    end           = ctx->move_ptr;
+    ctx->move_ptr = NULL;  // (the list does not outlive this function)
 
-    // set the board with each possible move and check if the king is in check
-    for (m = list_of_moves; m < move_ptr; m++) {
-        do_move(*m);
-        check = in_check(side, king_pos[play + 1]);
-        undo_move();
-        if (!check) return CHECK_GS;  // in check but not mat
-    }
-    return MAT_GS;  // mat
+    for (m = list_of_moves; m < end; m++)
+        if (is_legal(ctx, lg, *m)) return CHECK_GS;  // in check but not mat
+    return MAT_GS;
 }
 
-static int in_check_mat(int side)
+static int in_check_mat(engine_ctx_t *ctx, int side)
 {
-    if (!in_check(side, king_pos[play])) return WAIT_GS;  // not even in check
-    return in_mat(side);
+    legality_t lg;
+    list_pins_and_checks(ctx, side, &lg);
+    if (lg.nb_checkers == 0) return WAIT_GS;  // not even in check
+    return in_mat(ctx, side, &lg);
 }
 
 //------------------------------------------------------------------------------------
@@ -801,6 +1796,7 @@ static int in_check_mat(int side)
 char possible_moves_board[80];
 void set_possible_moves_board(int l, int c)
 {
+    engine_ctx_t *ctx = main_ctx;
     move_t move, list_of_moves[28];
     move_t* m;
 
@@ -809,19 +1805,18 @@ void set_possible_moves_board(int l, int c)
     move.from = 10*l + c;
 
     // Side check
-    int side = (play & 1) ? BLACK : WHITE;
+    int side = (ctx->play & 1) ? BLACK : WHITE;
     if ((B(move.from) & COLORS) != side) return;
 
     // List pseudo-legal moves
-    move_ptr = list_of_moves;
-    list_moves(move.from);
+    legality_t lg;
+    list_pins_and_checks(ctx, side, &lg);
+    ctx->move_ptr = list_of_moves;
+    list_moves(ctx, move.from);
 
     // Keep only legal moves
-    for (m = list_of_moves; m < move_ptr; m++) {
-        do_move(*m);
-        possible_moves_board[m->to] = (in_check(side, king_pos[play + 1])) ? 0 : 1;
-        undo_move();
-    }
+    for (m = list_of_moves; m < ctx->move_ptr; m++)
+        possible_moves_board[m->to] = is_legal(ctx, &lg, *m);
 }
 
 char get_possible_moves_board(int l, int c)
@@ -833,48 +1828,48 @@ char get_possible_moves_board(int l, int c)
 // Do the move, but only if it is legal
 //------------------------------------------------------------------------------------
 
-static int try_move(move_t move, int side)
+static int try_move(engine_ctx_t *ctx, move_t move, int side)
 {
     // Notice the piece type (for mv50)
     char type = B(move.from) & TYPE;
 
     // Try the move, then reject it if it puts the same side king in check
-    do_move(move);
-    if (in_check(side, king_pos[play + 1])) {
-        undo_move();
+    do_move(ctx, move);
+    if (in_check(ctx, side, ctx->king_pos[ctx->play + 1])) {
+        undo_move(ctx);
         return 0;
     }
 
     // The move was fully legal, accept it
-    nb_plays = play;
+    ctx->nb_plays = ctx->play;
 
     // Update the nb of "steril" moves
-    mv50 = (type == PAWN || move.eaten) ? 0 : mv50 + 1;
+    ctx->mv50 = (type == PAWN || move.eaten) ? 0 : ctx->mv50 + 1;
 
     return 1;
 }
 
-int try_move_str(char *move_str)
+int ctx_try_move_str(engine_ctx_t *ctx, char *move_str)
 {
     move_t move;
-    if (str_to_move(move_str, &move) == 0) return -1;
+    if (str_to_move(ctx, move_str, &move) == 0) return -1;
 
     // Side check
-    int side = (play & 1) ? BLACK : WHITE;
+    int side = (ctx->play & 1) ? BLACK : WHITE;
     if ((B(move.from) & COLORS) != side) return 0;
 
     // Verify if it is a pseudo-legal one
     move_t list_of_moves[28];
-    move_ptr = list_of_moves;
-    list_moves(move.from);
+    ctx->move_ptr = list_of_moves;
+    list_moves(ctx, move.from);
 
     move_t *m;
-    for (m = list_of_moves; m < move_ptr; m++)
+    for (m = list_of_moves; m < ctx->move_ptr; m++)
         if (m->val == move.val) break;
-    if (m == move_ptr) return 0;
+    if (m == ctx->move_ptr) return 0;
 
-    if (!try_move(move, side)) return 0;
-    log_info_va("Play %d: <- %.4s\n", play, move_str);
+    if (!try_move(ctx, move, side)) return 0;
+    log_info_va("Play %d: <- %.4s\n", ctx->play, move_str);
 
     if (move.special == PROMO_Q) return 2;
     return 1;
@@ -884,351 +1879,842 @@ int try_move_str(char *move_str)
 // Board Evaluation
 //------------------------------------------------------------------------------------
 
-static int evaluate(int side, int a, int b)
+// The evaluation terms are kept up to date by do_move(ctx): only taper them
+static int evaluate(engine_ctx_t *ctx, int side)
 {
-    int sq, piece, res;
+    eval_t *e = &ctx->eval[ctx->play];
+#ifdef SELF_CHECK
+    eval_t full;
+    compute_eval(ctx, &full);
+    if (memcmp(e, &full, sizeof(eval_t))) log_info_va("Play %d: wrong incremental evaluation\n", ctx->play);
+    if (wrong_pieces(ctx)) log_info_va("Play %d: wrong piece lists\n", ctx->play);
+#endif
 
-    // Take the total of the values of the pieces present on the board
-    res = board_val[play];
+    // From the middle game piece positions to the end game ones, as pieces disappear
+    int phase = (e->phase < PHASE_MAX) ? e->phase : PHASE_MAX;  // (promotions may add pieces)
+    int res   = e->board_val + e->pawn_front + (e->pos_mg * phase + e->pos_eg * (PHASE_MAX - phase)) / PHASE_MAX;
 
-    // If a piece has been eaten at the horizon, this is risky, so
-    // remove half of the value of the eating piece
-    if (moved[play - 1].eaten)
-        res -= piece_value[(int)B(moved[play - 1].to)] / 2;
+    return (side == BLACK) ? res : -res;
+}
 
-    if (side == BLACK) {
-        if (res > b + 170 || res < a - 170) return res;
-    }
-    else {
-        if (-res > b + 170 || -res < a - 170) return -res;
-    }
+#ifdef PROFILE
+PROFILED(int, evaluate, PROF_EVALUATE, (engine_ctx_t *ctx, int side), (ctx, side))
+#define evaluate profiled_evaluate
+#endif
 
-    // Center occupation
-    for (sq = 0; sq < 78; sq++) {
-        piece    = B(sq);
-        int type = piece & TYPE;
-        //        if (type == QUEEN || type == ROOK || type == KING) continue;
-        if (type == KING) continue;
-        if (piece & BLACK) {
-            res += black_pos_bonus[sq];  // (will be inverted if side = WHITE)
+//------------------------------------------------------------------------------------
+// Transposition Table management
+//------------------------------------------------------------------------------------
 
-            // Discourage own piece in front of pawn (including double pawn)
-            if (piece == B_PAWN && B(sq - 10) & BLACK) res -= 9;
-        }
-        else if (piece & WHITE) {
-            res -= white_pos_bonus[sq];
-            if (piece == W_PAWN && B(sq + 10) & WHITE) res += 9;
+static int get_table_entry(engine_ctx_t *ctx, int depth, int side, int* flag, int* eval, move_t* table_move)
+{
+    // The board key is maintained by do_move(ctx)
+    uint64_t hash = ctx->board_hash[ctx->play];
+#ifdef SELF_CHECK
+    if (hash != compute_hash(ctx)) log_info_va("Play %d: wrong incremental board key\n", ctx->play);
+#endif
+
+    // Look if the hash is in one of the entries of its cluster
+    table_t *e = ctx->table->clusters[hash & ctx->table->mask].entry;
+    ctx->stats.tt_probes++;
+    for (int i = 0; i < CLUSTER_SIZE; i++, e++) {
+        table_t t = *e;  // (another thread may be writing it)
+        if (!entry_matches(&t, hash) || is_stale(ctx, &t)) continue;
+
+        // To reduce hash collisions, reject an entry with impossible move
+        // (quiescence search entries may have no move)
+        move_t move;
+        move.from    = t.from;
+        move.to      = t.to;
+        move.eaten   = t.eaten;
+        move.special = t.special;
+        if (move.val == 0 || ((B(move.from) & COLORS) == side && B(move.to) == move.eaten)) {
+            // Only entries with same depth search are usable, but a move
+            // from other depth search is interesting (example: PV move)
+            *flag       = (t.depth == depth) ? t.flag : OTHER_DEPTH;
+            *eval       = t.eval;
+            *table_move = move;
+            e->generation = table_generation;
+            ctx->stats.tt_hits++;
+            return 1;
         }
     }
 
-    // Evaluations when there are few pieces
-    if (nb_pieces[play] < 24) {
-        for (sq = 0; sq < BOARD_SIZE - 2; sq++) {
-            piece = B(sq);
+    // The hash was not present or was for another board
+    table_move->val = 0;
+    *flag           = NEW_BOARD;
+    return 0;
+}
 
-            // Encourage pawns to advance to get promotion at end of game
-            if (piece == W_PAWN) res -= (sq / 10) << 3;
-            else if (piece == B_PAWN) res += (7 - (sq / 10)) << 3;
+#ifdef PROFILE
+PROFILED(int, get_table_entry, PROF_GET_TABLE_ENTRY, (engine_ctx_t *ctx, int depth, int side, int *flag, int *eval, move_t *table_move),
+         (ctx, depth, side, flag, eval, table_move))
+#define get_table_entry profiled_get_table_entry
+#endif
 
-            // Discourage king to go in a corner
-            else if (piece == W_KING) res += king_pos_malus[sq];
-            else if (piece == B_KING) res -= king_pos_malus[sq];
+static void set_table_entry(engine_ctx_t *ctx, int depth, int flag, int eval, move_t move)
+{
+    uint64_t hash = ctx->board_hash[ctx->play];
+    table_t *e    = ctx->table->clusters[hash & ctx->table->mask].entry;
+    table_t *replace = e, t;
+
+    // Overwrite the entry of the same board or a stale one, or else the least valuable
+    // one: the shallowest search, each search generation of age costing 8 plies
+    for (int i = 0; i < CLUSTER_SIZE; i++, e++) {
+        if (entry_matches(e, hash) || is_stale(ctx, e)) {
+            replace = e;
+            break;
         }
+        if (e->depth - 8 * table_entry_age(e) < replace->depth - 8 * table_entry_age(replace))
+            replace = e;
     }
-    return (side == BLACK) ? res : -res;
+    t.generation = table_generation;
+    t.from       = move.from;
+    t.to         = move.to;
+    t.eaten      = move.eaten;
+    t.special    = move.special;
+    t.depth      = depth;
+    t.flag       = flag;
+    t.eval       = eval;
+    replace->data  = t.data;
+    replace->check = hash ^ t.data;
 }
 
 //------------------------------------------------------------------------------------
-// Transposition Table management
+// Move picker: the moves are generated by stages, in descending order of interest to
+// improve alpha-beta prunning, each stage only when the previous ones did not cut
 //------------------------------------------------------------------------------------
 
-static int nb_dedup;
-static int nb_hash;
+// What a capture (or a promotion) wins
+static int capture_value(move_t m)
+{
+    int value = (m.special == EN_PASSANT) ? piece_value[B_PAWN] : abs_value(m.eaten);
+    if (m.special == PROMO_Q) value += piece_value[B_QUEEN] - piece_value[B_PAWN];
+    return value;
+}
 
-static int get_table_entry(int depth, int side, int* flag, int* eval)
+// Most valuable victim first, then least valuable attacker first
+static inline int capture_score(engine_ctx_t *ctx, move_t m)
 {
-    move_t move;
+    return 8 * capture_value(m) - abs_value(B(m.from)) / 100;
+}
 
-    // compute the hash of the board. Seed = castles + en_passant location...
-    uint32_t seed = (en_passant[play] << 24) + (castles[play] << 16) + (castles[play + 1] << 8) + (play & 1);
-    uint64_t hash = pengyhash((void *)board_ptr, BOARD_SIZE - 2, seed);
+static inline int is_capture(move_t m)
+{
+    return m.eaten || m.special == EN_PASSANT || m.special == PROMO_Q;
+}
 
-    // Look if the hash is in the transposition table
-    int h = hash & (TABLE_ENTRIES - 1);
-    if ((table[h].hash ^ hash) < TABLE_ENTRIES) {
-        // To reduce hash collisions, reject an entry with impossible move
-        move = table[h].move;
-        if ((B(move.from) & COLORS) == side && B(move.to) == move.eaten) {
-            // Only entries with same depth search are usable, but a move
-            // from other depth search is interesting (example: PV move)
-            *flag = (table[h].depth == depth) ? table[h].flag : OTHER_DEPTH;
+// Verify that a move from the transposition table or a killer move is possible on this board
+static int is_pseudo_legal(engine_ctx_t *ctx, move_t move, int side)
+{
+    move_t list_of_moves[28], *m;
 
-            *eval = table[h].eval;
-            return h;
+    if (move.val == 0 || (B(move.from) & COLORS) != side || B(move.to) != move.eaten) return 0;
+
+    ctx->move_ptr = list_of_moves;
+    list_moves(ctx, move.from);
+    for (m = list_of_moves; m < ctx->move_ptr; m++)
+        if (m->val == move.val) return 1;
+    return 0;
+}
+
+#define SORTED_QUIETS 4  // The next quiet moves are tried as listed (and reduced)
+
+enum pick_stage_t { PICK_TABLE_MOVE, PICK_CAPTURES, PICK_KILLERS, PICK_QUIETS, PICK_LOSING, PICK_END };
+
+typedef struct {
+    int stage, side;
+    move_t first[4];       // The transposition table move, the 2 killer moves, then the counter move
+    move_t killers[3];     // The killer moves (and counter move) to try
+    int16_t *cont[2];      // The continuation histories after the last move, and the one before
+    move_t *next, *end;    // The moves of the current stage still to try
+    move_t *losing;        // The captures that lose material, tried last
+    move_t *captures_end;  // The quiet moves are listed after the captures
+    move_t *list, *top;    // The moves listed on the move stack, and their end
+    int *score;
+} picker_t;
+
+// The continuation history of the moves that follow the move played plies ago, or NULL if
+// it is unknown (no move, null move, or its piece was taken since)
+static int16_t *cont_history_after(engine_ctx_t *ctx, int plies)
+{
+    if (ctx->play < plies) return NULL;
+    move_t m = ctx->moved[ctx->play - plies];
+    if (m.val == 0 || (plies == 2 && ctx->moved[ctx->play - 1].val && ctx->moved[ctx->play - 1].to == m.to)) return NULL;
+    int type = B(m.to) & TYPE;
+    return (type < PAWN) ? NULL : &ctx->cont_history[type - PAWN][m.to][0][0];
+}
+
+static void init_picker(engine_ctx_t *ctx, picker_t *p, int side, int level, move_t table_move)
+{
+    move_t last;
+    last.val = ctx->play ? ctx->moved[ctx->play - 1].val : 0;
+
+    p->stage    = PICK_TABLE_MOVE - 1;
+    p->side     = side;
+    p->first[0] = table_move;
+    p->first[1] = ctx->best_move[level];
+    p->first[2] = ctx->next_best[level];
+    p->first[3] = ctx->counter_move[last.from][last.to];
+    p->cont[0]  = cont_history_after(ctx, 1);
+    p->cont[1]  = cont_history_after(ctx, 2);
+    p->list     = p->top = ctx->move_top;
+    p->score    = MOVE_SCORE(ctx, p->list);
+#ifdef SELF_CHECK
+    if (p->list + MAX_BOARD_MOVES > MOVE_STACK(ctx) + MOVE_STACK_SIZE) log_info_va("Play %d: move stack overflow\n", ctx->play);
+#endif
+    p->next     = p->end = p->list;
+}
+
+// How often a quiet move cut: by itself, and after the last two moves
+static inline int quiet_score(engine_ctx_t *ctx, picker_t *p, move_t m)
+{
+    int i     = ((B(m.from) & TYPE) - PAWN) * BOARD_SIZE + m.to;
+    int score = ctx->history[SIDE_INDEX(p->side)][m.from][m.to];
+    if (p->cont[0]) score += p->cont[0][i];
+    if (p->cont[1]) score += p->cont[1][i];
+    return score;
+}
+
+// Return the next move to try, or NULL when there is none left
+static move_t *next_move(engine_ctx_t *ctx, picker_t *p, int no_quiets)
+{
+    move_t *m, *q, tmp;
+    pieces_t *pl = &ctx->pieces[ctx->play];
+    uint8_t *squares = pl->sq[SIDE_INDEX(p->side)];
+    int i, nb, best;
+
+    while (1) {
+        while (p->next < p->end) {
+            m = p->next++;
+
+            // Pick the best remaining capture, or quiet move among the first ones, but keep
+            // a capture for the end if it loses material
+            if (p->stage == PICK_CAPTURES || (p->stage == PICK_QUIETS && m - p->captures_end < SORTED_QUIETS)) {
+                best = m - p->list;
+                for (i = best + 1; i < p->end - p->list; i++)
+                    if (p->score[i] > p->score[best]) best = i;
+                tmp = *m, *m = p->list[best], p->list[best] = tmp;
+                i = p->score[m - p->list], p->score[m - p->list] = p->score[best], p->score[best] = i;
+
+                if (p->stage == PICK_CAPTURES && losing_capture(ctx, *m)) {
+                    p->end--;
+                    tmp = *m, *m = *p->end, *p->end = tmp;
+                    i = p->score[m - p->list], p->score[m - p->list] = p->score[p->end - p->list], p->score[p->end - p->list] = i;
+                    p->next--;
+                    continue;
+                }
+            }
+
+            // Do not try twice the same move
+            if (p->stage != PICK_TABLE_MOVE && m->val == p->first[0].val) continue;
+            if (p->stage == PICK_QUIETS && (m->val == p->first[1].val || m->val == p->first[2].val || m->val == p->first[3].val)) continue;
+            return m;
         }
+
+        switch (++p->stage) {
+        case PICK_TABLE_MOVE:
+            if (is_pseudo_legal(ctx, p->first[0], p->side)) {
+                p->next = &p->first[0];
+                p->end  = &p->first[1];
+            }
+            break;
+
+        case PICK_CAPTURES:
+            ctx->move_ptr = p->list;
+            for (i = 0; i < pl->nb[SIDE_INDEX(p->side)]; i++) list_captures(ctx, squares[i]);
+            p->next = p->list;
+            p->end  = p->captures_end = p->top = ctx->move_ptr;
+            for (m = p->list; m < p->end; m++) p->score[m - p->list] = capture_score(ctx, *m);
+            break;
+
+        case PICK_KILLERS:
+            p->losing = p->end;
+            p->next   = p->end = p->killers;
+            for (i = 1; i < 4; i++) {
+                m = &p->first[i];
+                if (is_capture(*m) || m->val == p->first[0].val || (i >= 2 && m->val == p->first[1].val)
+                    || (i == 3 && m->val == p->first[2].val)) continue;
+                if (is_pseudo_legal(ctx, *m, p->side)) *p->end++ = *m;
+            }
+            break;
+
+        case PICK_QUIETS:
+            if (no_quiets) break;  // (futility pruning)
+
+            // List all the pseudo legal moves, then keep the quiet ones
+            ctx->move_ptr = p->captures_end;
+            nb = pl->nb[SIDE_INDEX(p->side)];
+            if (ctx->root->randomize) {
+                best = (((int)__rdtsc()) & 0x7FFFFFFF) % nb;  // (the first piece)
+                for (i = 0; i < nb; i++) list_moves(ctx, squares[(best + i) % nb]);
+            }
+            else {
+                for (i = 0; i < nb; i++) list_moves(ctx, squares[i]);
+            }
+            for (m = q = p->captures_end; m < ctx->move_ptr; m++)
+                if (!is_capture(*m)) {
+                    p->score[q - p->list] = quiet_score(ctx, p, *m);
+                    *q++ = *m;
+                }
+            p->next = p->captures_end;
+            p->end  = p->top = q;
+            break;
+
+        case PICK_LOSING:
+            p->next = p->losing;
+            p->end  = p->captures_end;
+            break;
+
+        default:
+            return NULL;
+        }
+    }
+}
+
+#define HISTORY_MAX 8192  // The history values tend to it, without going over
+
+// Move a history value toward +/-HISTORY_MAX, the slower the closer
+static inline void add_history(int16_t *h, int bonus)
+{
+    *h += bonus - *h * abs(bonus) / HISTORY_MAX;
+}
+
+// A quiet move cut: reward it, also as the reply to the last move, and penalize the
+// quiet moves tried before it
+static void update_quiet_history(engine_ctx_t *ctx, picker_t *p, int depth, move_t cut, move_t *quiets, int nb_quiets)
+{
+    int bonus = (depth < 20) ? depth * depth : 400;
+
+    for (int i = 0; i <= nb_quiets; i++) {
+        move_t m = (i < nb_quiets) ? quiets[i] : cut;
+        int b    = (i < nb_quiets) ? -bonus : bonus;
+        int j    = ((B(m.from) & TYPE) - PAWN) * BOARD_SIZE + m.to;
+        add_history(&ctx->history[SIDE_INDEX(p->side)][m.from][m.to], b);
+        if (p->cont[0]) add_history(&p->cont[0][j], b);
+        if (p->cont[1]) add_history(&p->cont[1][j], b);
     }
+    if (ctx->play && ctx->moved[ctx->play - 1].val)
+        ctx->counter_move[ctx->moved[ctx->play - 1].from][ctx->moved[ctx->play - 1].to] = cut;
+}
 
-    // The hash was not present or was for another board. Set the table entry
-    table[h].hash     = hash;
-    table[h].move.val = 0;
-    *flag             = NEW_BOARD;
-    nb_hash++;
-    return h;
+// Between searches, halve the history values, so that the last cutoffs weigh more
+static void age_history(engine_ctx_t *ctx)
+{
+    int16_t *h = &ctx->history[0][0][0];
+    for (size_t i = 0; i < sizeof(ctx->history) / sizeof(int16_t); i++) h[i] /= 2;
+    h = &ctx->cont_history[0][0][0][0];
+    for (size_t i = 0; i < sizeof(ctx->cont_history) / sizeof(int16_t); i++) h[i] /= 2;
 }
 
+#ifdef PROFILE
+PROFILED(move_t *, next_move, PROF_NEXT_MOVE, (engine_ctx_t *ctx, picker_t *p, int no_quiets), (ctx, p, no_quiets))
+#define next_move profiled_next_move
+#endif
+
 //------------------------------------------------------------------------------------
-// Sort moves in descending order of interest to improve alpha-beta prunning
+// Quiescence search: at the horizon, only search captures until the board is quiet
 //------------------------------------------------------------------------------------
 
-static void fast_sort_moves(move_t* list, int nb_moves, int level, move_t table_move)
-{
-    // Indexes of attacks in the sparsely filled sorted_attacks[] list.
-    // Attacks ordering is "most valuable victim by least valuable attacker" first.
-    // Index starts at 3 to leave place for the PV move and 2 killer moves.
-    // Use as follows: attack_indexes[8*attacker_type + victim_type]. Up to 2x 3 queens
-    int attack_indexes[64] = {
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 98, 3, 76, 55, 33, 3,
-        0, 0, 156, 3, 96, 75, 53, 32,
-        0, 0, 112, 3, 80, 59, 37, 9,
-        0, 0, 122, 3, 84, 63, 41, 15,
-        0, 0, 130, 3, 86, 65, 43, 18,
-        0, 0, 134, 3, 90, 69, 47, 23 }; // sparse attack list minimal size: 163
-
-#define LAST_ATTACK_INDEX ((KING << 3) + PAWN)
-
-    unsigned int sorted_attacks[192] = {0};
-    unsigned int other_moves[256];
-    int i, i_max, a, m, o;
-
-    // get all move scores
-    for (m = 0, o = 0; m < nb_moves; m++) {
-        unsigned int val = list[m].val;
-
-        // Give the 1st rank to the Transition Table move (PV move or other)
-        if (val == table_move.val)
-            sorted_attacks[0] = val;
-
-        // Give the 2nd rank to the previous best move at this level (the "killer" move)
-        else if (val == best_move[level].val)
-            sorted_attacks[1] = val;
-
-        // Give the 2nd rank to the previous best move at this level (the "killer" move)
-        else if (val == next_best[level].val)
-            sorted_attacks[2] = val;
-
-        // place the attacking moves in a sparsely filled, but ordered list
-        else if (list[m].eaten) {
-            // get the index in the attack_indexes[] table (8*attacker + victim)
-            i = ((B(list[m].from) & 7) << 3) + (list[m].eaten & 7);
-            // sorted_attacks[i] is the place for this attack
-            sorted_attacks[attack_indexes[i]++] = val;
+// Count the searched moves. Every 10000 moves, the main thread looks at elapsed time.
+// Return 1 if time's up
+static inline int search_stopped(engine_ctx_t *ctx)
+{
+    if (++ctx->ab_moves > ctx->next_ab_moves_time_check) {
+        if (ctx == ctx->root && get_chrono(ctx) >= ctx->curr_budget_ms) ctx->stop_search = 1;
+        if (ctx->max_moves && ctx->nb_moves + ctx->ab_moves >= ctx->max_moves) ctx->stop_search = 1;
+        ctx->next_ab_moves_time_check = ctx->ab_moves + 10000;
+    }
+    return ctx->root->stop_search;
+}
+
+#define DELTA_MARGIN 200  // Max positional gain of a capture, on top of the eaten piece
+
+static int quiesce(engine_ctx_t *ctx, int a, int b, int side, legality_t *lg)
+{
+    int i, j, flag, eval, max, stand_pat = 0, old_a = a, check = lg->nb_checkers;
+    legality_t next_lg;
+    pieces_t *pl = &ctx->pieces[ctx->play];
+    move_t *list_of_moves = ctx->move_top;  // (on the move stack)
+    int *score = MOVE_SCORE(ctx, list_of_moves);
+    move_t *m, mm_move, table_move;
+    mm_move.val = 0;
+    ctx->stats.q_nodes++;
+#ifdef SELF_CHECK
+    if (list_of_moves + MAX_BOARD_MOVES > MOVE_STACK(ctx) + MOVE_STACK_SIZE) log_info_va("Play %d: move stack overflow\n", ctx->play);
+#endif
+
+    // Search the board in the transposition table (quiescence entries have depth 0)
+    get_table_entry(ctx, 0, side, &flag, &eval, &table_move);
+    if (flag == EXACT_VALUE || (flag == LOWER_BOUND && eval >= b) || (flag == UPPER_BOUND && eval <= a)) {
+        ctx->stats.tt_cutoffs++;
+        return eval;
+    }
+
+    // Stand pat: the side to play may decline all the captures, unless in check
+    if (check) max = -300000;
+    else {
+        max = stand_pat = evaluate(ctx, side);
+        if (max >= b) return max;
+        if (max > a) a = max;
+    }
+
+    // In check, list the moves to escape. Otherwise, only the captures
+    ctx->move_ptr = list_of_moves;
+    if (check) list_evasions(ctx, side, lg);
+    else
+        for (i = 0; i < pl->nb[SIDE_INDEX(side)]; i++) list_captures(ctx, pl->sq[SIDE_INDEX(side)][i]);
+    int nb_of_moves = ctx->move_ptr - list_of_moves;
+
+    for (i = 0; i < nb_of_moves; i++) score[i] = capture_score(ctx, list_of_moves[i]);
+
+    for (i = 0; i < nb_of_moves; i++) {
+        // Pick the best remaining move
+        for (j = i + 1; j < nb_of_moves; j++) {
+            if (score[j] > score[i]) {
+                int s = score[i];
+                score[i] = score[j], score[j] = s;
+                move_t t = list_of_moves[i];
+                list_of_moves[i] = list_of_moves[j], list_of_moves[j] = t;
+            }
+        }
+        m = &list_of_moves[i];
+
+        // Delta pruning: skip the captures that cannot raise the score up to alpha,
+        // and the ones that lose material
+        if (!check && stand_pat + capture_value(*m) + DELTA_MARGIN <= a) continue;
+        if (!check && losing_capture(ctx, *m)) continue;
+        if (!is_legal(ctx, lg, *m)) continue;
+
+        do_move(ctx, *m);
+        list_pins_and_checks(ctx, side ^ COLORS, &next_lg);
+        ctx->move_top = list_of_moves + nb_of_moves;  // (the next board lists its moves above)
+        eval = -quiesce(ctx, -b, -a, side ^ COLORS, &next_lg);
+        undo_move(ctx);
+
+        if (search_stopped(ctx)) return -400000;
+
+        if (eval > max) {
+            max     = eval;
+            mm_move = *m;
+            if (max >= b) break;
+            if (max > a) a = max;
         }
-        // place the non attacking moves in another list
-        else other_moves[o++] = val;
     }
-    // Compact the sorted attacks list
-    i_max = attack_indexes[LAST_ATTACK_INDEX];
-    for (i = 0, a = 0; i < i_max; i++)
-        if (sorted_attacks[i]) sorted_attacks[a++] = sorted_attacks[i];
 
-    // Finally put back the sorted attacks and the other moves in the input list
-    if (a) memcpy(list, sorted_attacks, a * sizeof(int));
-    if (o) memcpy(list + a, other_moves, o * sizeof(int));
+    if      (max <= old_a) flag = UPPER_BOUND;
+    else if (max >= b)     flag = LOWER_BOUND;
+    else                   flag = EXACT_VALUE;
+    set_table_entry(ctx, 0, flag, max, mm_move);
+    return max;
 }
 
 //------------------------------------------------------------------------------------
 // The min-max recursive algo with alpha-beta pruning
 //------------------------------------------------------------------------------------
 
-static int level_max;
-static int ab_moves, next_ab_moves_time_check;
+#define NULL_VERIFY_PHASE 6  // Below, zugzwang is frequent enough to verify null move cutoffs
 
-static int nega_alpha_beta(int level, int a, int b, int side, move_t *upper_sequence)
+// Whether the side has other pieces than its king and pawns
+static inline int has_pieces(engine_ctx_t *ctx, int side)
 {
-    int i, p, from, check, flag, eval, max = -300000, one_possible = 0;
-    move_t list_of_moves[256];
-    move_t sequence[LEVEL_MAX];
+    pieces_t *pl = &ctx->pieces[ctx->play];
+    for (int i = 0; i < pl->nb[SIDE_INDEX(side)]; i++)
+        if ((B(pl->sq[SIDE_INDEX(side)][i]) & TYPE) > KING) return 1;
+    return 0;
+}
+
+// The legality information of the board (check, pins) is found by the caller, after its move.
+// level is the ply from the root, and depth the plies left to search (less with reductions)
+static int nega_alpha_beta(engine_ctx_t *ctx, int level, int depth, int a, int b, int side, legality_t *lg)
+{
+    int check = lg->nb_checkers, flag, eval, max = -300000, one_possible = 0, nb_tried = 0, nb_quiets = 0;
+    legality_t next_lg;
+    picker_t picker;
+    move_t quiets[64];  // The quiet moves tried that did not cut
     move_t *m;
     move_t mm_move;
     mm_move.val = 0;
+    ctx->pv_length[level] = level;  // (no sequence yet)
 
-    if ((check = in_check_mat(side)) == MAT_GS) return max;
-
-    // Last level: evaluate the board
-    int depth = level_max - level;
-    if (depth == 0) return evaluate(side, a, b);
+    // Last level: evaluate the board once it is quiet
+    if (depth <= 0) return quiesce(ctx, a, b, side, lg);
 
     // Search the board in the transposition table
-    int h = get_table_entry(depth, side, &flag, &eval);
+    move_t table_move;
+    get_table_entry(ctx, depth, side, &flag, &eval, &table_move);
 
     int old_a = a;
     if      (flag == LOWER_BOUND) { if (a < eval) a = eval; }
     else if (flag == UPPER_BOUND) { if (b > eval) b = eval; }
     if      (flag == EXACT_VALUE || (a >= b && flag > OTHER_DEPTH)) {
-        nb_dedup++;
-        mm_move          = table[h].move;
-        next_best[level] = best_move[level];
-        best_move[level] = mm_move;
-        sequence[level]  = mm_move;
-        memcpy(upper_sequence, sequence, level_max * sizeof(move_t));  // reductible...
+        ctx->stats.tt_cutoffs++;
+        mm_move               = table_move;
+        ctx->next_best[level] = ctx->best_move[level];
+        ctx->best_move[level] = mm_move;
+        ctx->pv[level][level] = mm_move;
+        if (mm_move.val) ctx->pv_length[level] = level + 1;
         return eval;
     }
 
-    // List all the pseudo legal moves
-    move_ptr = list_of_moves;
-    if (randomize) {
-        from = (((int)__rdtsc()) & 0x7FFFFFFF) % (BOARD_SIZE - 2);
-        for (i = 0; i < BOARD_SIZE - 2; i++, from++) {
-            if (from == BOARD_SIZE - 2) from = 0;
-            if (B(from) & side) list_moves(from);
+    // Null move: if passing the turn still fails high on a search reduced by R plies, a move
+    // would too. Not in check (passing is illegal), nor twice in a row, nor with only pawns
+    // left, where passing could be the best option (zugzwang)
+    if (level > 0 && depth >= 2 && b - a == 1 && !check && !ctx->no_null && ctx->moved[ctx->play - 1].val
+        && evaluate(ctx, side) >= b && has_pieces(ctx, side)) {
+        int R = (depth > 6) ? 3 : 2;
+        move_t *move_top = ctx->move_top;  // (the searches below list their moves above it)
+
+        do_null_move(ctx);
+        list_pins_and_checks(ctx, side ^ COLORS, &next_lg);
+        eval = -nega_alpha_beta(ctx, level + 1, depth - 1 - R, -b, -a, side ^ COLORS, &next_lg);
+        undo_null_move(ctx);
+        ctx->move_top = move_top;
+        if (search_stopped(ctx)) return -400000;
+
+        // In the end game, verify it by a reduced search without null move
+        if (eval >= b && ctx->eval[ctx->play].phase <= NULL_VERIFY_PHASE) {
+            ctx->no_null++;
+            eval = nega_alpha_beta(ctx, level, depth - R, a, b, side, lg);
+            ctx->no_null--;
+            ctx->move_top = move_top;
+            if (ctx->root->stop_search) return -400000;
+        }
+        if (eval >= b) {
+            ctx->stats.null_cutoffs++;
+            return (eval > 199800) ? b : eval;  // (passing cannot prove a mat)
         }
     }
-    else {
-        for (from = 0; from < BOARD_SIZE - 2; from++)
-            if (B(from) & side) list_moves(from);
-    }
-    int nb_of_moves = move_ptr - list_of_moves;
-    if (nb_of_moves == 0)
-        return (side == engine_side) ? -100000 : 100000; // Avoid "Pats"
-    move_ptr->val = 0;
-
-    // List king protectors: no king check verification will be done on non-protectors moves
-    int king_protectors[8];
-    int king_protectors_nb = 0;
-    if (!check) king_protectors_nb = list_king_protectors(side, &king_protectors[0]);
 
     // Set the Futility level
     int futility = 300000;  // by default, no futility
-    if (depth == 1 && !check && nb_pieces[play] > 23)
-        futility = 50 + ((side == BLACK) ? board_val[play] : -board_val[play]);
-
-    // Sort the moves to maximize alpha beta pruning efficiency
-    fast_sort_moves(list_of_moves, nb_of_moves, level, table[h].move);
-
-    // Try each possible move
-    for (m = list_of_moves; m->val; m++) {
-        // Once the max level reached, only evaluate "eating" moves. We'll stop
-        // on a "stablized" eating situation that will provide a better evaluation (algo 2)
-        //        if (level > level_max && B(m->to) == 0) continue;
+    if (depth == 1 && !check && ctx->eval[ctx->play].nb_pieces > 23)
+        futility = 50 + ((side == BLACK) ? ctx->eval[ctx->play].board_val : -ctx->eval[ctx->play].board_val);
 
+    // Try each possible move, the most promising first
+    init_picker(ctx, &picker, side, level, table_move);
+    while ((m = next_move(ctx, &picker, futility < max && one_possible))) {
         // Futility pruning
-        if (futility < max && one_possible && B(m->to) == 0) continue;
-
-        // set the board with this possible move
-        do_move(*m);
-
-        // do not allow the move if it puts (or leaves) the own king in check
-        if (!check) {
-            // No need to check check for moves from pieces that don't protect the king
-            for (p = 0; p < king_protectors_nb && m->from != king_protectors[p]; p++) continue;
-            if (p == king_protectors_nb) goto after_check_check;
-        }
-        if (in_check(side, king_pos[play + 1])) {
-            undo_move();
+        if (futility < max && one_possible && B(m->to) == 0) {
+            ctx->stats.futility_prunes++;
             continue;
         }
-    after_check_check:
+
+        // Just before the horizon, captures that lose material are not worth a try
+        if (depth == 1 && !check && one_possible && picker.stage == PICK_LOSING) continue;
+
+        // set the board with this possible move, if it is legal
+        if (!is_legal(ctx, lg, *m)) continue;
+        nb_tried++;
+        do_move(ctx, *m);
+        list_pins_and_checks(ctx, side ^ COLORS, &next_lg);
+        ctx->move_top = picker.top;  // (the next board lists its moves above the ones of this board)
 
         // evaluate this move
         if (one_possible == 0) {
             one_possible = 1;
-            eval = -nega_alpha_beta(level + 1, -b, -a, side ^ COLORS, sequence);
+            eval = -nega_alpha_beta(ctx, level + 1, depth - 1, -b, -a, side ^ COLORS, &next_lg);
         }
         else {
-            eval = -nega_alpha_beta(level + 1, -a - 1, -a, side ^ COLORS, sequence);
+            // Late quiet moves that do not check are first searched less deep (less in the
+            // PV), and again at full depth if they raise alpha
+            int r = 0;
+            if (picker.stage == PICK_QUIETS && m->special != PROMO_N && !check && !next_lg.nb_checkers) {
+                r = reduction[depth][(nb_tried < 63) ? nb_tried : 63];
+                if (r && b - a > 1) r--;
+            }
+            eval = -nega_alpha_beta(ctx, level + 1, depth - 1 - r, -a - 1, -a, side ^ COLORS, &next_lg);
+            if (r) {
+                ctx->stats.reductions++;
+                if (eval > a) {
+                    ctx->stats.re_searches++;
+                    eval = -nega_alpha_beta(ctx, level + 1, depth - 1, -a - 1, -a, side ^ COLORS, &next_lg);
+                }
+            }
             if (a < eval && eval < b && depth > 2)
-                eval = -nega_alpha_beta(level + 1, -b, -a, side ^ COLORS, sequence);
+                eval = -nega_alpha_beta(ctx, level + 1, depth - 1, -b, -a, side ^ COLORS, &next_lg);
         }
 
         // undo the move to evaluate the others
-        undo_move();
+        undo_move(ctx);
 
-        // Every 10000 moves, look at elapsed time
-        if (++ab_moves > next_ab_moves_time_check) {
-            // if time's up, stop search and keep previous lower depth search move
-            if (get_chrono() >= curr_budget_ms) return -400000;
-            next_ab_moves_time_check = ab_moves + 10000;
-        }
+        // if time's up, stop search and keep previous lower depth search move
+        if (search_stopped(ctx)) return -400000;
 
         // Penalty on certain 1st moves
         if (level == 0) {
             char type = B(m->from) & TYPE;
 
             // Discourage too many successive "sterile" moves (rule is 50 max)
-            if (mv50 > 24 && type != PAWN && !m->eaten) eval -= mv50;
+            if (ctx->mv50 > 24 && type != PAWN && !m->eaten) eval -= ctx->mv50;
 
             // Discourage king move and rook move at the beginning of the game
             if (type == KING) eval -= 8;
-            if (type >= ROOK && play < 10) eval -= 20;
+            if (type >= ROOK && ctx->play < 10) eval -= 20;
 
             // Discourage move back and perpetual move loops
-            if (play > 6) {
-                if (m->from == moved[play - 2].to   && m->to == moved[play - 2].from) eval -= 10;
-                if (m->from == moved[play - 4].from && m->to == moved[play - 4].to  ) eval -= 30;
-                if (m->from == moved[play - 6].to   && m->to == moved[play - 6].from) eval -= 100;
-                if (play > 12) {
-                    if (m->from == moved[play -  8].from && m->to == moved[play -  8].to) eval -= 300;
-                    if (m->from == moved[play - 12].from && m->to == moved[play - 12].to) eval -= 600;
+            if (ctx->play > 6) {
+                if (m->from == ctx->moved[ctx->play - 2].to   && m->to == ctx->moved[ctx->play - 2].from) eval -= 10;
+                if (m->from == ctx->moved[ctx->play - 4].from && m->to == ctx->moved[ctx->play - 4].to  ) eval -= 30;
+                if (m->from == ctx->moved[ctx->play - 6].to   && m->to == ctx->moved[ctx->play - 6].from) eval -= 100;
+                if (ctx->play > 12) {
+                    if (m->from == ctx->moved[ctx->play -  8].from && m->to == ctx->moved[ctx->play -  8].to) eval -= 300;
+                    if (m->from == ctx->moved[ctx->play - 12].from && m->to == ctx->moved[ctx->play - 12].to) eval -= 600;
                 }
             }
         }
 
-        // The player wants to maximize his score
-        if (eval > max) {
-            max              = eval;  // max = max( max, eval )
-            mm_move          = *m;
-            next_best[level] = best_move[level];
-            best_move[level] = mm_move;
-            sequence[level]  = mm_move;
-            memcpy(upper_sequence, sequence, level_max * sizeof(move_t));
-
-            if (max >= b) goto end_add_to_tt;
+        // The player wants to maximize his score (at the root, keep a move even if all are mated)
+        if (eval > max || (level == 0 && mm_move.val == 0)) {
+            max                   = eval;  // max = max( max, eval )
+            mm_move               = *m;
+            ctx->next_best[level] = ctx->best_move[level];
+            ctx->best_move[level] = mm_move;
+
+            // The sequence of this level is the move, then the one of the next level
+            ctx->pv[level][level] = mm_move;
+            for (int l = level + 1; l < ctx->pv_length[level + 1]; l++) ctx->pv[level][l] = ctx->pv[level + 1][l];
+            ctx->pv_length[level] = ctx->pv_length[level + 1];
+
+            if (max >= b) {
+                ctx->stats.cutoffs++;
+                if (nb_tried == 1) ctx->stats.first_move_cutoffs++;
+                if (!is_capture(*m)) update_quiet_history(ctx, &picker, depth, *m, quiets, nb_quiets);
+                goto end_add_to_tt;
+            }
             if (max > a) a = max;
         }
+        if (!is_capture(*m) && nb_quiets < 64) quiets[nb_quiets++] = *m;
+    }
+    // No legal move: mat, or "pat"
+    if (one_possible == 0) {
+        if (check) return max;
+        return (side == ctx->engine_side) ? -100000 : 100000;  // Avoid "Pats"
     }
-    if (one_possible == 0)
-        return (side == engine_side) ? -100000 : 100000;  // Avoid "Pats"
 
 end_add_to_tt:
-    table[h].eval     = max;
-    table[h].move.val = mm_move.val;
-    table[h].depth    = depth;
-    if  (max <= old_a) table[h].flag = UPPER_BOUND;
-    else if (max >= b) table[h].flag = LOWER_BOUND;
-    else               table[h].flag = EXACT_VALUE;
+    if      (max <= old_a) flag = UPPER_BOUND;
+    else if (max >= b)     flag = LOWER_BOUND;
+    else                   flag = EXACT_VALUE;
+    set_table_entry(ctx, depth, flag, max, mm_move);
     return max;
 }
 
+//------------------------------------------------------------------------------------
+// Lazy SMP: helper threads search the same board, sharing the transposition table
+//------------------------------------------------------------------------------------
+
+static void *helper_search(void *arg)
+{
+    engine_ctx_t *ctx = arg;
+    legality_t lg;
+
+    list_pins_and_checks(ctx, ctx->engine_side, &lg);
+
+    // Odd helpers start one level deeper, to spread the threads over two depths
+    for (ctx->level_max = ctx->thread_id & 1; ctx->level_max < ctx->level_max_max && !ctx->root->stop_search;) {
+        ctx->best_move[ctx->level_max].val = 0;
+        ctx->next_best[ctx->level_max].val = 0;
+        ctx->level_max++;
+        ctx->nb_moves += ctx->ab_moves;
+        ctx->ab_moves  = 0;
+
+        ctx->move_top = MOVE_STACK(ctx);
+        nega_alpha_beta(ctx, 0, ctx->level_max, -400000, 400000, ctx->engine_side, &lg);
+    }
+    return NULL;
+}
+
+// Give the thread t its own copy of the game
+static engine_ctx_t *copy_for_thread(engine_ctx_t *ctx, int t)
+{
+    if (ctx->helper_ctx[t] == NULL && (ctx->helper_ctx[t] = malloc(sizeof(engine_ctx_t))) == NULL) return NULL;
+
+    engine_ctx_t *helper = ctx->helper_ctx[t];
+    memcpy(helper, ctx, sizeof(engine_ctx_t));
+    helper->board_ptr = BOARD0(helper) + (ctx->board_ptr - BOARD0(ctx));
+    helper->move_top  = MOVE_STACK(helper);
+    helper->thread_id = t;
+    return helper;
+}
+
+static void start_helpers(engine_ctx_t *ctx)
+{
+    ctx->stop_search = 0;
+    for (int t = 1; t < nb_threads; t++) {
+        engine_ctx_t *helper = copy_for_thread(ctx, t);
+        if (helper == NULL) break;
+
+        helper->nb_moves  = 0;
+        helper->ab_moves  = 0;
+        memset(&helper->stats, 0, sizeof(search_stats_t));
+        helper->next_ab_moves_time_check = 10000;
+
+        if (pthread_create(&ctx->helper_thread[t], NULL, helper_search, helper)) break;
+        ctx->nb_helpers = t;
+    }
+}
+
+// Stop the helpers and return the number of moves they searched
+static long stop_helpers(engine_ctx_t *ctx)
+{
+    long nb_moves = 0;
+
+    ctx->stop_search = 1;
+    for (int t = 1; t <= ctx->nb_helpers; t++) {
+        search_stats_t *st = &ctx->helper_ctx[t]->stats;
+        pthread_join(ctx->helper_thread[t], NULL);
+        nb_moves += ctx->helper_ctx[t]->nb_moves + ctx->helper_ctx[t]->ab_moves;
+
+        ctx->stats.q_nodes            += st->q_nodes;
+        ctx->stats.tt_probes          += st->tt_probes;
+        ctx->stats.tt_hits            += st->tt_hits;
+        ctx->stats.tt_cutoffs         += st->tt_cutoffs;
+        ctx->stats.cutoffs            += st->cutoffs;
+        ctx->stats.first_move_cutoffs += st->first_move_cutoffs;
+        ctx->stats.futility_prunes    += st->futility_prunes;
+        ctx->stats.null_cutoffs       += st->null_cutoffs;
+        ctx->stats.reductions         += st->reductions;
+        ctx->stats.re_searches        += st->re_searches;
+    }
+    ctx->nb_helpers = 0;
+    return nb_moves;
+}
+
 //------------------------------------------------------------------------------------
 // The compute engine : how we'll call the min-max recursive algo
 //------------------------------------------------------------------------------------
 
-void compute_next_move(void)
+// Percentage, with 0 for nothing
+#define PERCENT(n, total) ((total) ? 100.0 * (n) / (total) : 0.0)
+
+#ifdef PROFILE
+static search_stats_t profile_total;  // Of all the searches since the start
+
+// Send (or only log) the table of the cycles spent by the hot functions, of which the
+// cycles of the functions they call (in_check in is_legal, for instance)
+static void send_profile_table(search_stats_t *st, int send)
 {
-    move_t engine_move;
-    long level_ms = 0, elapsed_ms = 0;
+    char str[128];
+
+    snprintf(str, 128, "# %-21s %11s %10s %6s %7s\n", "function", "calls", "Mcycles", "%", "cycles");
+    log_info(str + 2);
+    if (send) send_str(str);
+    for (int i = 0; i < NB_PROFILED; i++) {
+        snprintf(str, 128, "# %-21s %11llu %10.1f %6.1f %7.1f\n", profiled_names[i], (unsigned long long)st->calls[i],
+                 st->cycles[i] / 1e6, PERCENT(st->cycles[i], st->search_cycles), st->calls[i] ? (double)st->cycles[i] / st->calls[i] : 0.0);
+        log_info(str + 2);
+        if (send) send_str(str);
+    }
+    snprintf(str, 128, "# %-21s %11s %10.1f\n", "search", "", st->search_cycles / 1e6);
+    log_info(str + 2);
+    if (send) send_str(str);
+}
+#endif
 
-    engine_side = (play & 1) ? BLACK : WHITE;
+// Log the statistics of the search, and also send them as comment lines (ignored by xboard)
+static void send_stats(engine_ctx_t *ctx)
+{
+    search_stats_t *st = &ctx->stats;
+    char str[6][128];
+
+    snprintf(str[0], 128, "# moves %ld, quiescence boards %ld, %ld moves/s\n", st->moves, st->q_nodes, st->moves * 1000 / (st->ms + 1));
+    snprintf(str[1], 128, "# table probes %ld, hits %.1f%%, cutoffs %ld\n", st->tt_probes, PERCENT(st->tt_hits, st->tt_probes), st->tt_cutoffs);
+    snprintf(str[2], 128, "# beta cutoffs %ld, by the first move %.1f%%\n", st->cutoffs, PERCENT(st->first_move_cutoffs, st->cutoffs));
+    snprintf(str[3], 128, "# futility prunes %ld, null move cutoffs %ld\n", st->futility_prunes, st->null_cutoffs);
+    snprintf(str[4], 128, "# late move reductions %ld, re-searched %.1f%%\n", st->reductions, PERCENT(st->re_searches, st->reductions));
+    snprintf(str[5], 128, "# aspiration window fails %ld, last window %d\n", st->window_fails, st->window);
+    for (int i = 0; i < 6; i++) {
+        log_info(str[i] + 2);
+        if (ctx->verbose) send_str(str[i]);
+    }
+
+#ifdef PROFILE
+    send_profile_table(st, ctx->verbose);
+    for (int i = 0; i < NB_PROFILED; i++) {
+        profile_total.calls[i]  += st->calls[i];
+        profile_total.cycles[i] += st->cycles[i];
+    }
+    profile_total.search_cycles += st->search_cycles;
+#endif
+}
+
+// Profile build: where the cycles of all the searches went, since the start
+void send_profile(void)
+{
+#ifdef PROFILE
+    send_profile_table(&profile_total, 1);
+#endif
+}
+
+// The statistics of the last search, as one JSON line
+int ctx_search_stats(engine_ctx_t *ctx, char *str, int size)
+{
+    search_stats_t *st = &ctx->stats;
+    int n = snprintf(str, size,
+        "{\"level\":%d,\"ms\":%ld,\"moves\":%ld,\"moves_per_s\":%ld,\"quiescence_boards\":%ld,"
+        "\"tt_probes\":%ld,\"tt_hits\":%ld,\"tt_hit_rate\":%.3f,\"tt_cutoffs\":%ld,"
+        "\"cutoffs\":%ld,\"first_move_cutoffs\":%ld,\"first_move_cutoff_rate\":%.3f,"
+        "\"futility_prunes\":%ld,\"null_cutoffs\":%ld,\"reductions\":%ld,\"re_searches\":%ld,"
+        "\"window_fails\":%ld,\"window\":%d,\"branching_factors\":[",
+        st->level, st->ms, st->moves, st->moves * 1000 / (st->ms + 1), st->q_nodes,
+        st->tt_probes, st->tt_hits, PERCENT(st->tt_hits, st->tt_probes) / 100, st->tt_cutoffs,
+        st->cutoffs, st->first_move_cutoffs, PERCENT(st->first_move_cutoffs, st->cutoffs) / 100,
+        st->futility_prunes, st->null_cutoffs, st->reductions, st->re_searches,
+        st->window_fails, st->window);
+
+    for (int l = 2; l <= st->level && n < size; l++)
+        n += snprintf(str + n, size - n, "%s%.2f", (l > 2) ? "," : "", st->level_moves[l - 1] ? (double)st->level_moves[l] / st->level_moves[l - 1] : 0.0);
+    if (n < size) n += snprintf(str + n, size - n, "]}\n");
+    return n;
+}
+
+// For a test position, note when a solution is found, and forget it if it is changed
+static int check_solution(engine_ctx_t *ctx, move_t m, long ms, long moves)
+{
+    int i, solved = (ctx->nb_best_moves == 0);
+
+    for (i = 0; i < ctx->nb_best_moves; i++)
+        if (ctx->best_moves[i].val == m.val) solved = 1;
+    for (i = 0; i < ctx->nb_avoid_moves; i++)
+        if (ctx->avoid_moves[i].val == m.val) solved = 0;
+
+    if (!solved) ctx->solved_ms = ctx->solved_moves = -1;
+    else if (ctx->solved_ms < 0) {
+        ctx->solved_ms    = ms;
+        ctx->solved_moves = moves;
+    }
+    return solved;
+}
+
+#define ASPIRATION_WINDOW 30  // Around the previous score, then 4 times wider at each fail
+
+void ctx_compute_next_move(engine_ctx_t *ctx)
+{
+    move_t engine_move, completed_move;  // (the best move of the last completed level)
+    legality_t lg;
+    char mv_str[8];
+    long level_ms = 0, elapsed_ms = 0, nb_moves = 0;
+    int max = 0;
+
+    ctx->engine_side = (ctx->play & 1) ? BLACK : WHITE;
+    memset(&ctx->stats, 0, sizeof(search_stats_t));
 
     // Verify the situation...
-    if (in_check_mat(engine_side) == MAT_GS) {
-        game_state = LOST_GS;
+    if (in_check_mat(ctx, ctx->engine_side) == MAT_GS) {
+        ctx->game_state = LOST_GS;
         return;
     }
 
     // Don't waist time thinking for the 1st move.
-    if (play == 0) {
+    if (ctx->use_book && ctx->play == 0 && ctx->board_hash[0] == start_hash) {
         engine_move.val = first_ply[rand() % 5].val;
         goto play_the_prefered_move;
     }
 #ifdef WITH_BOOK
     // Optionally consult the opening moves book.
-    else if (use_book && play < 16) {
-        // compute the board hash. Seed = castles + en_passant + color to play...
-        uint32_t seed = (en_passant[play] << 24) + (castles[play] << 16) + (castles[play + 1] << 8) + (play & 1);
-        uint64_t hash = pengyhash((void *)board_ptr, BOARD_SIZE - 2, seed);
+    else if (ctx->use_book && ctx->play < 16) {
+        uint64_t hash = ctx->board_hash[ctx->play];
 #ifdef __MINGW32__
         log_info_va("Look in book hash 0x%0llX : ", hash);
 #else
@@ -1245,61 +2731,575 @@ void compute_next_move(void)
         log_info("not found\n");
     }
 #endif
-    start_chrono();
+    start_chrono(ctx);
+#ifdef PROFILE
+    ctx->stats.search_cycles = __rdtsc();
+#endif
 
     // Search deeper and deeper the best move,
     // starting with the previous "best" move to improve prunning
-    level_max       = 0;
-    engine_move.val = 0;
-    curr_budget_ms  = time_budget_ms + unused_ms;
+    ctx->level_max   = 0;
+    ctx->nb_moves    = 0;
+    ctx->ab_moves    = 0;
+    engine_move.val  = 0;
+    completed_move.val = 0;
+    ctx->pv[0][0].val = 0;
+    ctx->curr_budget_ms = ctx->time_budget_ms + ctx->unused_ms;
+    table_generation++;
+    if ((uint8_t)(table_generation - ctx->table_epoch) == 255) ctx->table_epoch++;  // Keep the age span in 8 bits
+
+    age_history(ctx);
+    start_helpers(ctx);
+    list_pins_and_checks(ctx, ctx->engine_side, &lg);
 
     do {
-        best_move[level_max].val = 0;
-        next_best[level_max].val = 0;
-        level_max++;
-        ab_moves                 = 0;
-        next_ab_moves_time_check = ab_moves + 10000;
-        nb_dedup                 = 0;
-        nb_hash                  = 0;
-
-        int max = nega_alpha_beta(0, -400000, 400000, engine_side, best_sequence);
-        engine_move = best_sequence[0];
+        ctx->best_move[ctx->level_max].val = 0;
+        ctx->next_best[ctx->level_max].val = 0;
+        ctx->level_max++;
+        ctx->nb_moves                += ctx->ab_moves;
+        ctx->ab_moves                 = 0;
+        ctx->next_ab_moves_time_check = ctx->ab_moves + 10000;
+
+        // From level 5, first search around the score of the previous level, and widen
+        // the side that fails until the score falls inside the window
+        int a = -400000, b = 400000, delta = ASPIRATION_WINDOW, fails = 0;
+        if (ctx->level_max >= 5 && max > -199800 && max < 199800) a = max - delta, b = max + delta;
+        while (1) {
+            ctx->move_top = MOVE_STACK(ctx);
+            max = nega_alpha_beta(ctx, 0, ctx->level_max, a, b, ctx->engine_side, &lg);
+            if (ctx->stop_search || (a < max && max < b)) break;
+            fails++;
+            delta *= 4;
+            if (max <= a) a = (delta < 2000) ? a - delta : -400000;
+            else          b = (delta < 2000) ? b + delta :  400000;
+        }
+        ctx->stats.window_fails += fails;
+        ctx->stats.window        = (a > -400000 && b < 400000) ? b - a : 0;
+        engine_move = ctx->pv[0][0];
+
+        // Stopped inside an aspiration window, or after it failed: the moves of this level
+        // are not proven better, so play the one of the last completed level
+        if (ctx->stop_search && completed_move.val && (fails || a > -400000 || b < 400000)) engine_move = completed_move;
         if (engine_move.val == 0) {
-            game_state = PAT_GS;
+            stop_helpers(ctx);
+            ctx->game_state = PAT_GS;
             return;
         }
 
+        // Time's up: keep the best move found so far (by the previous level or by this one)
+        if (ctx->stop_search) break;
+        completed_move = engine_move;
+
         level_ms   = -elapsed_ms;
-        elapsed_ms = get_chrono();
+        elapsed_ms = get_chrono(ctx);
         level_ms  += elapsed_ms;
+        ctx->stats.level = ctx->level_max;
+        ctx->stats.level_moves[ctx->level_max] = ctx->ab_moves;
 
-        if (verbose) {
-            send_str_va("%2d %7d %4ld %8d ", level_max, max, elapsed_ms / 10, ab_moves);
-            for (int l = 0; l < level_max && l < 13; l++)
-                send_str_va(" %s", move_str(best_sequence[l]));
+        if (ctx->nb_best_moves + ctx->nb_avoid_moves) check_solution(ctx, engine_move, elapsed_ms, ctx->nb_moves + ctx->ab_moves);
+
+        if (ctx->verbose) {
+            send_str_va("%2d %7d %4ld %8d ", ctx->level_max, max, elapsed_ms / 10, ctx->ab_moves);
+            for (int l = 0; l < ctx->pv_length[0] && l < 13; l++)
+                send_str_va(" %s", move_str(ctx->pv[0][l], mv_str));
             send_str("\n");
+            if (ctx->level_max > 1 && ctx->stats.level_moves[ctx->level_max - 1])
+                send_str_va("# branching factor %.2f\n", (double)ctx->ab_moves / ctx->stats.level_moves[ctx->level_max - 1]);
+            if (ctx->level_max >= 5)
+                send_str_va("# window %d to %d, fails %d\n", a, b, fails);
         }
 
         // If a check-mat is un-avoidable, no need to think more
         if (max > 199800 || max < -199800) break;
 
         // Evaluate if we have time for the next search level
-        if (level_ms * 4 > curr_budget_ms - elapsed_ms) break;
-    } while (level_max <= LEVEL_MAX);
-    total_ms += elapsed_ms;
+        if (level_ms * 4 > ctx->curr_budget_ms - elapsed_ms) break;
+    } while (ctx->level_max < ctx->level_max_max);
+
+    nb_moves = ctx->nb_moves + ctx->ab_moves + stop_helpers(ctx);
+    elapsed_ms = get_chrono(ctx);
+    ctx->total_ms += elapsed_ms;
+    ctx->stats.moves = nb_moves;
+    ctx->stats.ms    = elapsed_ms;
+#ifdef PROFILE
+    ctx->stats.search_cycles = __rdtsc() - ctx->stats.search_cycles;
+#endif
+    send_stats(ctx);
 
 play_the_prefered_move:
-    unused_ms += time_budget_ms - elapsed_ms;
+    ctx->searched_moves = nb_moves;
+    ctx->unused_ms += ctx->time_budget_ms - elapsed_ms;
 
-    try_move(engine_move, engine_side);
-    engine_move_str = move_str(engine_move);
+    try_move(ctx, engine_move, ctx->engine_side);
+    move_str(engine_move, ctx->engine_move_str);
 
-    log_info_va("Play %d: -> %s\n", play, engine_move_str);
-    log_info_va("Table entries created: %d, Deduplications: %d\n", nb_hash, nb_dedup);
+    log_info_va("Play %d: -> %s\n", ctx->play, ctx->engine_move_str);
+    log_info_va("Moves searched by %d thread(s): %ld, %ld moves/s\n", nb_threads, nb_moves, nb_moves * 1000 / (elapsed_ms + 1));
     log_info_va("Think time: %d min %d sec %d ms\n", (int)(elapsed_ms / 60000), (int)((elapsed_ms / 1000) % 60), (int)(elapsed_ms % 1000));
-    log_info_va("Unused time: %d min %d sec %d ms\n", (int)(unused_ms / 60000), (int)((unused_ms / 1000) % 60), (int)(unused_ms % 1000));
-    log_info_va("Total think time: %d min %d sec %d ms\n", (int)(total_ms / 60000), (int)((total_ms / 1000) % 60), (int)(total_ms % 1000));
+    log_info_va("Unused time: %d min %d sec %d ms\n", (int)(ctx->unused_ms / 60000), (int)((ctx->unused_ms / 1000) % 60), (int)(ctx->unused_ms % 1000));
+    log_info_va("Total think time: %d min %d sec %d ms\n", (int)(ctx->total_ms / 60000), (int)((ctx->total_ms / 1000) % 60), (int)(ctx->total_ms % 1000));
 
     // Return with the opponent side situation
-    game_state = in_check_mat(engine_side ^ COLORS);
+    ctx->game_state = in_check_mat(ctx, ctx->engine_side ^ COLORS);
+}
+
+//------------------------------------------------------------------------------------
+// Perft: count the boards reached by all the move sequences of a given length, to
+// verify the move generation and measure its speed
+//------------------------------------------------------------------------------------
+
+// Optional table of sub-tree counts, shared by the threads without lock: an entry
+// is only found if its check matches, which a half written entry does not
+typedef struct {
+    uint64_t check;  // key ^ nodes
+    uint64_t nodes;
+} perft_entry_t;
+
+typedef struct perft perft_t;
+
+typedef struct {
+    perft_t *pt;
+    engine_ctx_t *ctx;  // The copy of the game of the thread
+    pthread_t thread;
+} perft_worker_t;
+
+// The work of a perft: the threads take the root moves one by one
+struct perft {
+    perft_entry_t *table;
+    uint64_t mask;
+    int depth;
+    int nb_moves;
+    volatile int next_move;
+    move_t moves[256];
+    uint64_t nodes[256];
+    perft_worker_t worker[MAX_THREADS];
+};
+
+static uint64_t perft_count(engine_ctx_t *ctx, perft_t *pt, int depth, int side)
+{
+    move_t list_of_moves[256], *m, *end;
+    pieces_t *pl = &ctx->pieces[ctx->play];
+    perft_entry_t *e = NULL;
+    uint64_t key = 0, nodes = 0;
+    legality_t lg;
+
+    if (pt->table && depth > 1) {
+        key = ctx->board_hash[ctx->play] + depth * 0x9E3779B97F4A7C15ULL;
+        e   = &pt->table[key & pt->mask];
+        if ((e->check ^ e->nodes) == key) return e->nodes;
+    }
+
+    list_pins_and_checks(ctx, side, &lg);
+    ctx->move_ptr = list_of_moves;
+    if (lg.nb_checkers) list_evasions(ctx, side, &lg);
+    else
+        for (int i = 0; i < pl->nb[SIDE_INDEX(side)]; i++) list_moves(ctx, pl->sq[SIDE_INDEX(side)][i]);
+    end = ctx->move_ptr;
+
+    for (m = list_of_moves; m < end; m++) {
+        if (!is_legal(ctx, &lg, *m)) continue;
+
+        // Bulk counting: the moves of the last ply are not played
+        if (depth == 1) {
+            nodes++;
+            continue;
+        }
+        do_move(ctx, *m);
+        nodes += perft_count(ctx, pt, depth - 1, side ^ COLORS);
+        undo_move(ctx);
+    }
+
+    if (e) {
+        e->nodes = nodes;
+        e->check = key ^ nodes;
+    }
+    return nodes;
+}
+
+static void *perft_worker(void *arg)
+{
+    perft_worker_t *w = arg;
+    perft_t *pt       = w->pt;
+    engine_ctx_t *ctx = w->ctx;
+    int i, side = (ctx->play & 1) ? BLACK : WHITE;
+
+    while ((i = __sync_fetch_and_add(&pt->next_move, 1)) < pt->nb_moves) {
+        if (pt->depth == 1) {
+            pt->nodes[i] = 1;
+            continue;
+        }
+        do_move(ctx, pt->moves[i]);
+        pt->nodes[i] = perft_count(ctx, pt, pt->depth - 1, side ^ COLORS);
+        undo_move(ctx);
+    }
+    return NULL;
+}
+
+// Perft of the board, split at the root between nb_threads threads, with an optional
+// table of hash_mb mega bytes. With divide, also send the count of each root move
+uint64_t ctx_perft(engine_ctx_t *ctx, int depth, int divide, int hash_mb)
+{
+    move_t list_of_moves[256], *m;
+    legality_t lg;
+    uint64_t nodes = 0;
+    char mv_str[8];
+    int i, t, nb_workers = 1, side = (ctx->play & 1) ? BLACK : WHITE;
+
+    perft_t *pt = calloc(1, sizeof(perft_t));
+    if (pt == NULL) return 0;
+    if (depth > MAX_TURNS - 1 - ctx->play) depth = MAX_TURNS - 1 - ctx->play;
+    pt->depth = (depth < 1) ? 1 : depth;
+
+    if (hash_mb > 0) {
+        size_t size = (size_t)1 << 20;
+        while (2 * size <= ((size_t)hash_mb << 20)) size *= 2;  // Round down to a power of 2
+        if ((pt->table = calloc(size / sizeof(perft_entry_t), sizeof(perft_entry_t))))
+            pt->mask = size / sizeof(perft_entry_t) - 1;
+    }
+
+    // The legal moves of the root
+    list_pins_and_checks(ctx, side, &lg);
+    ctx->move_ptr = list_of_moves;
+    if (lg.nb_checkers) list_evasions(ctx, side, &lg);
+    else
+        for (i = 0; i < ctx->pieces[ctx->play].nb[SIDE_INDEX(side)]; i++) list_moves(ctx, ctx->pieces[ctx->play].sq[SIDE_INDEX(side)][i]);
+    for (m = list_of_moves; m < ctx->move_ptr; m++)
+        if (is_legal(ctx, &lg, *m)) pt->moves[pt->nb_moves++] = *m;
+
+    // Each helper thread works on its own copy of the game
+    pt->worker[0].pt  = pt;
+    pt->worker[0].ctx = ctx;
+    for (t = 1; t < nb_threads; t++) {
+        pt->worker[t].pt  = pt;
+        pt->worker[t].ctx = copy_for_thread(ctx, t);
+        if (pt->worker[t].ctx == NULL || pthread_create(&pt->worker[t].thread, NULL, perft_worker, &pt->worker[t])) break;
+        nb_workers++;
+    }
+    perft_worker(&pt->worker[0]);
+    for (t = 1; t < nb_workers; t++) pthread_join(pt->worker[t].thread, NULL);
+
+    for (i = 0; i < pt->nb_moves; i++) {
+        nodes += pt->nodes[i];
+        if (divide) send_str_va("%s: %llu\n", move_str(pt->moves[i], mv_str), (unsigned long long)pt->nodes[i]);
+    }
+    free(pt->table);
+    free(pt);
+    return nodes;
+}
+
+//------------------------------------------------------------------------------------
+// Bench: search a fixed set of positions at a fixed depth, to measure the search speed.
+// The number of searched moves only changes when the search behaviour changes.
+//------------------------------------------------------------------------------------
+
+static char *bench_positions[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r1bqkbnr/pppp1ppp/2n5/1B2p3/4P3/5N2/PPPP1PPP/RNBQK2R b KQkq - 3 3",
+    "rnbqkb1r/pp2pppp/3p1n2/8/3NP3/8/PPP2PPP/RNBQKB1R w KQkq - 1 5",
+    "r1bqk2r/pppp1ppp/2n2n2/2b1p3/2B1P3/2N2N2/PPPP1PPP/R1BQK2R w KQkq - 6 5",
+    "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+    "rnbqkb1r/pppp1ppp/8/4P3/6n1/7P/PPPNPPP1/R1BQKBNR b KQkq - 0 5",
+    "rnbqkb1r/p3pppp/1p6/2ppP3/3N4/2P5/PPP1QPPP/R1B1KB1R w KQkq - 0 7",
+    "r1b1kb1r/3q1ppp/pBp1pn2/8/Np3P2/5B2/PPP3PP/R2Q1RK1 w kq - 0 13",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r3k2r/pPppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "r2q1rk1/pp2ppbp/2np1np1/8/3NP3/2N1BP2/PPPQ2PP/R3KB1R w KQ - 3 9",
+    "2kr1bnr/pbpq4/2n1pp2/3p3p/3P1P1B/2N2N1Q/PPP3PP/2KR1B1R w - - 0 13",
+    "2rr3k/pp3pp1/1nnqbN1p/3pN3/2pP4/2P3Q1/PPB4P/R4RK1 w - - 0 20",
+    "5rk1/1ppb3p/p1pb4/6q1/3P1p1r/2P1R2P/PP1BQ1P1/5RKN w - - 0 25",
+    "r1bq2rk/pp3pbp/2p1p1pQ/7P/3P4/2PB1N2/PP3PPR/2KR4 w - - 0 17",
+    "r4q1k/p2bR1rp/2p2Q1N/5p2/5p2/2P5/PP3PPP/R5K1 w - - 0 22",
+    "3q1rk1/p4pp1/2pb3p/3p4/6Pr/1PNQ4/P1PB1PP1/4RRK1 b - - 0 20",
+    "2br2k1/2q3rn/p2NppQ1/2p1P3/Pp5R/4P3/1P3PPP/3R2K1 w - - 0 28",
+    "4k1r1/2p3r1/1pR1p3/3pP2p/3P2qP/P4N2/1PQ4P/5R1K b - - 0 30",
+    "5rk1/pp4p1/2n1p2p/2Npq3/2p5/6P1/P3P1BP/R4Q1K w - - 0 24",
+    "1k1r4/pp1b1R2/3q2pp/4p3/2B5/4Q3/PPP2B2/2K5 b - - 0 28",
+    "3r1k2/4npp1/1ppr3p/p6P/P2PPPP1/1NR5/5K2/2R5 w - - 0 31",
+    "2q1rr1k/3bbnnp/p2p1pp1/2pPp3/PpP1P1P1/1P2BNNP/2BQ1PRK/7R b - - 0 30",
+    "1nk1r1r1/pp2n1pp/4p3/q2pPp1N/b1pP1P2/B1P2R2/2P1B1PP/R2Q2K1 w - - 0 21",
+    "3rr1k1/pp3pp1/1qn2np1/8/3p4/PP1R1P2/2P1NQPP/R1B3K1 b - - 0 22",
+    "5k2/6pp/p1qN4/1p1p4/3P4/2PKP2Q/PP3r2/3R4 b - - 0 33",
+    "2r3k1/pppR1pp1/4p3/4P1P1/5P2/1P4K1/P1P5/8 w - - 0 32",
+    "4b3/p3kp2/6p1/3pP2p/2pP1P2/4K1P1/P3N2P/8 w - - 0 35",
+    "8/7p/5k2/5p2/p1p2P2/Pr1pPK2/1P1R3P/8 b - - 0 40",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 40",
+    "7k/p7/1R5K/6r1/6p1/6P1/8/8 w - - 0 45",
+    "8/5pk1/6p1/8/3R4/6P1/5PK1/2r5 w - - 0 40",
+    "6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 40",
+    "8/1p3k2/p1p5/2P5/1P3K2/P7/8/8 w - - 0 40",
+    "8/8/3bk3/8/3K4/4N3/4P3/8 w - - 0 50",
+    "8/8/2k5/5q2/8/2K5/3Q4/8 w - - 0 60",
+    "8/8/4k3/8/2K5/3P4/8/8 w - - 0 50",
+};
+
+// Search each bench position at 'depth' in a new game, with a new table of hash_mb mega
+// bytes of its own, without book nor randomness, and return the number of searched moves.
+// It is reproducible with one thread only, as the helpers run free.
+uint64_t bench(int depth, int hash_mb)
+{
+    trans_table_t own_table = { NULL, 0, 0 };
+    uint64_t nodes = 0;
+
+    engine_ctx_t *ctx = new_engine_ctx();
+    if (ctx == NULL) return 0;
+    init_trans_table(&own_table, hash_mb);  // So that no other search interferes, nor is disturbed
+    ctx->table    = &own_table;
+    ctx->use_book = 0;
+    ctx->verbose  = 0;
+
+    for (int i = 0; i < (int)(sizeof(bench_positions) / sizeof(bench_positions[0])); i++) {
+        ctx->table_epoch = table_generation + 1;
+        ctx_init_game(ctx, bench_positions[i]);
+        ctx->level_max_max  = (depth < 1) ? 1 : (depth > LEVEL_MAX) ? LEVEL_MAX : depth;
+        ctx->time_budget_ms = 0x3FFFFFFF;  // The depth limits the search, not the time
+        ctx_compute_next_move(ctx);
+        nodes += ctx->searched_moves;
+        if (verbose) send_str_va("%2d %-5s %ld\n", i + 1, ctx->engine_move_str, ctx->searched_moves);
+    }
+
+    release_trans_table(&own_table);
+    free_engine_ctx(ctx);
+    return nodes;
+}
+
+//------------------------------------------------------------------------------------
+// Test suites: search EPD positions, whose bm operation gives the move(s) to find and
+// am the move(s) to avoid, and measure how fast the engine finds a solution
+//------------------------------------------------------------------------------------
+
+// Find the legal move written in standard algebraic notation (Nbd7, exf6, e8=Q+, O-O...)
+static int san_to_move(engine_ctx_t *ctx, char *san, move_t *move)
+{
+    move_t list_of_moves[256], *m;
+    legality_t lg;
+    char str[8];
+    int len = 0, type = PAWN, to, from_c = -1, from_l = -1, promo = 0, castle = 0;
+    int side = (ctx->play & 1) ? BLACK : WHITE;
+
+    if (!strncmp(san, "O-O-O", 5) || !strncmp(san, "0-0-0", 5)) castle = -2;
+    else if (!strncmp(san, "O-O", 3) || !strncmp(san, "0-0", 3)) castle = 2;
+    else {
+        // Keep the piece, origin, destination and promotion: drop captures, checks and annotations
+        for (; *san && !strchr(" ;", *san) && len < 7; san++)
+            if (!strchr("x:+#!?=", *san)) str[len++] = *san;
+        str[len] = 0;
+
+        if (len > 2 && strchr("NBRQ", str[len - 1])) promo = str[--len];
+        if (promo == 'R' || promo == 'B') return 0;  // The engine only promotes to queen or knight
+        if (len < 2 || str[len - 2] < 'a' || str[len - 2] > 'h' || str[len - 1] < '1' || str[len - 1] > '8') return 0;
+        to = 10 * (str[len - 1] - '1') + str[len - 2] - 'a';
+
+        if (str[0] && strchr("KNBRQ", str[0])) type = strchr(piece_char + WHITE, str[0]) - piece_char - WHITE;
+        for (int i = (type == PAWN) ? 0 : 1; i < len - 2; i++) {
+            if (str[i] >= 'a' && str[i] <= 'h') from_c = str[i] - 'a';
+            else if (str[i] >= '1' && str[i] <= '8') from_l = str[i] - '1';
+            else if (str[i] != 'P') return 0;
+        }
+    }
+
+    list_pins_and_checks(ctx, side, &lg);
+    ctx->move_ptr = list_of_moves;
+    if (lg.nb_checkers) list_evasions(ctx, side, &lg);
+    else
+        for (int i = 0; i < ctx->pieces[ctx->play].nb[SIDE_INDEX(side)]; i++) list_moves(ctx, ctx->pieces[ctx->play].sq[SIDE_INDEX(side)][i]);
+
+    for (m = list_of_moves; m < ctx->move_ptr; m++) {
+        if (castle) {
+            if ((B(m->from) & TYPE) != KING || m->to - m->from != castle) continue;
+        }
+        else {
+            if ((B(m->from) & TYPE) != type || m->to != to) continue;
+            if ((from_c >= 0 && m->from % 10 != from_c) || (from_l >= 0 && m->from / 10 != from_l)) continue;
+            if ((m->special == PROMO_Q || m->special == PROMO_N) ? (m->special == PROMO_N) != (promo == 'N') : promo) continue;
+        }
+        if (!is_legal(ctx, &lg, *m)) continue;
+        *move = *m;
+        ctx->move_ptr = NULL;
+        return 1;
+    }
+    ctx->move_ptr = NULL;
+    return 0;
+}
+
+// Read the moves of the bm or am operation at str, up to the ';'
+static int epd_moves(engine_ctx_t *ctx, char *str, move_t *moves)
+{
+    int nb = 0;
+    for (; *str && *str != ';'; str++) {
+        if (*str == ' ') continue;
+        if (nb < 8 && san_to_move(ctx, str, &moves[nb])) nb++;
+        while (str[1] && str[1] != ' ' && str[1] != ';') str++;
+    }
+    return nb;
+}
+
+// The operation after the one at str: after its ';', unless in a quoted string
+static char *next_operation(char *str)
+{
+    for (int quoted = 0; *str && (quoted || *str != ';'); str++)
+        if (*str == '"') quoted = !quoted;
+    if (*str) str++;
+    while (*str == ' ') str++;
+    return str;
+}
+
+// Search the EPD position in a new game of ctx, for ms milli-seconds (or max_moves
+// searched moves when not 0). Return 1 if it is solved, -1 if the EPD has no usable
+// bm or am operation. An unsolved position gets the time and moves of the whole search.
+// Without hmvc and fmvn operations, the position is taken as a middle game one (move 20),
+// as the engine plays the first moves of a game with some care for its opening.
+int ctx_epd_search(engine_ctx_t *ctx, char *epd, long ms, long max_moves, epd_result_t *res)
+{
+    char FEN[128], *str, *ops;
+    int fields = 0, hmvc = 0, fmvn = 20, saved_use_book = ctx->use_book, saved_verbose = ctx->verbose;
+
+    memset(res, 0, sizeof(epd_result_t));
+
+    // The 4 fields of the board, then the operations
+    for (str = epd; *str && fields < 4; str++) {
+        if (*str == ' ' && str[1] != ' ') fields++;
+        if (str - epd >= (int)sizeof(FEN) - 10) return -1;  // (room for the move counters)
+    }
+    if (fields < 4) return -1;
+    for (ops = str; *ops; ops = next_operation(ops)) {
+        if (!strncmp(ops, "hmvc ", 5)) hmvc = atoi(ops + 5);
+        if (!strncmp(ops, "fmvn ", 5)) fmvn = atoi(ops + 5);
+    }
+    hmvc = (hmvc < 0) ? 0 : (hmvc > 999)  ? 999  : hmvc;
+    fmvn = (fmvn < 1) ? 1 : (fmvn > 9999) ? 9999 : fmvn;
+    memcpy(FEN, epd, str - epd);
+    snprintf(FEN + (str - epd), sizeof(FEN) - (str - epd), "%d %d", hmvc, fmvn);
+
+    ctx_init_game(ctx, FEN);
+    ctx->nb_best_moves = ctx->nb_avoid_moves = 0;
+    for (; *str; str = next_operation(str)) {
+        if (!strncmp(str, "bm ", 3)) ctx->nb_best_moves = epd_moves(ctx, str + 3, ctx->best_moves);
+        if (!strncmp(str, "am ", 3)) ctx->nb_avoid_moves = epd_moves(ctx, str + 3, ctx->avoid_moves);
+        if (!strncmp(str, "id \"", 4)) sscanf(str + 4, "%31[^\"]", res->id);
+    }
+    if (ctx->nb_best_moves + ctx->nb_avoid_moves == 0) return -1;
+
+    // Search it as a new game, without book nor randomness
+    ctx->table_epoch = table_generation + 1;
+    ctx->use_book    = 0;
+    ctx->verbose     = 0;
+    ctx->solved_ms = ctx->solved_moves = -1;
+    ctx->time_budget_ms = (ms > 0) ? ms : 0x3FFFFFFF;
+    ctx->max_moves      = max_moves;
+    ctx_compute_next_move(ctx);
+    ctx->use_book = saved_use_book;
+    ctx->verbose  = saved_verbose;
+
+    // The last level may be incomplete: judge the move played, if any
+    move_t played;
+    played.val = (ctx->game_state == LOST_GS || ctx->game_state == PAT_GS) ? 0 : ctx->moved[ctx->play - 1].val;
+    move_str(played, res->move);
+    res->solved = check_solution(ctx, played, ctx->total_ms, ctx->searched_moves);
+    res->tts_ms    = res->solved ? ctx->solved_ms : ctx->total_ms;
+    res->tts_moves = res->solved ? ctx->solved_moves : ctx->searched_moves;
+    ctx->nb_best_moves = ctx->nb_avoid_moves = 0;
+    ctx->max_moves     = 0;
+    return res->solved;
+}
+
+//------------------------------------------------------------------------------------
+// Play interfaces (chess.c, chessx.c): a single game, with its state in globals
+//------------------------------------------------------------------------------------
+
+char *engine_move_str = "";
+
+int game_state      = WAIT_GS;
+int play            = 0;
+int nb_plays        = 0;
+int randomize       = 0;
+int level_max_max   = LEVEL_MAX;
+long time_budget_ms = 2000;
+
+// Copy the game state of the context to the globals
+static void get_game_state(void)
+{
+    play     = main_ctx->play;
+    nb_plays = main_ctx->nb_plays;
+}
+
+void init_game(char *FEN_string)
+{
+    if (main_ctx == NULL && (main_ctx = new_engine_ctx()) == NULL) {
+        log_info("Could not allocate the game\n");
+        exit(1);
+    }
+
+    // Forget the transposition table entries of the previous game by starting a new epoch,
+    // unless the consecutive positions to analyse belong to the same game
+    if (!keep_table) main_ctx->table_epoch = table_generation + 1;
+
+    ctx_init_game(main_ctx, FEN_string);
+    get_game_state();
+    engine_move_str = main_ctx->engine_move_str;
+    game_state      = main_ctx->game_state;
+    time_budget_ms  = main_ctx->time_budget_ms;
+    randomize       = main_ctx->randomize;
+    level_max_max   = main_ctx->level_max_max;
+}
+
+int try_move_str(char *move_str)
+{
+    int res = ctx_try_move_str(main_ctx, move_str);
+    get_game_state();
+    return res;
+}
+
+void compute_next_move(void)
+{
+    // Take the settings changed by the play interface
+    main_ctx->time_budget_ms = time_budget_ms;
+    main_ctx->randomize      = randomize;
+    main_ctx->level_max_max  = level_max_max;
+    main_ctx->use_book       = use_book;
+    main_ctx->verbose        = verbose;
+
+    ctx_compute_next_move(main_ctx);
+    get_game_state();
+    game_state = main_ctx->game_state;  // Last, as the play interface may poll it
+}
+
+void user_undo_move(void)
+{
+    ctx_undo_move(main_ctx);
+    get_game_state();
+}
+
+void user_redo_move(void)
+{
+    ctx_redo_move(main_ctx);
+    get_game_state();
+}
+
+void set_piece(char ch, int l, int c)
+{
+    put_piece(main_ctx, ch, l, c);
+}
+
+char get_piece(int l, int c)
+{
+    engine_ctx_t *ctx = main_ctx;
+    return piece_char[(int)(B(10 * l + c))];
+}
+
+char *get_move_str(int p)
+{
+    return move_str(main_ctx->moved[p], main_ctx->mv_str);
+}
+
+uint64_t perft(int depth, int divide)
+{
+    return ctx_perft(main_ctx, depth, divide, 0);
+}
+
+int search_stats(char *str, int size)
+{
+    return ctx_search_stats(main_ctx, str, size);
 }
@@ -18,14 +18,17 @@
 #define ANIM_GS  6
 #define QUIT_GS  7
 
-#define LEVEL_MAX 63
+#define LEVEL_MAX   63
+#define MAX_THREADS 64
 
 // Common variables : game settings
 
 extern int   use_book;
 extern int   verbose;
 extern int   randomize;
+extern int   keep_table;
 extern int   level_max_max;
+extern int   nb_threads;
 extern int   trace;
 
 // Common variables : game current state
@@ -36,7 +39,45 @@ extern int   play;
 extern int   nb_plays;
 extern long  time_budget_ms;
 
-// Chess engine functions
+// Chess engine functions: each game (or analysis) is an engine context.
+// Several contexts can be searched at once by different threads, all of
+// them sharing the transposition table.
+
+typedef struct engine_ctx engine_ctx_t;
+
+int   set_table_size( int mb );
+engine_ctx_t* new_engine_ctx( void );
+void  free_engine_ctx( engine_ctx_t* ctx );
+void  ctx_init_game( engine_ctx_t* ctx, char* FEN_string );
+int   ctx_try_move_str( engine_ctx_t* ctx, char* move_str );
+void  ctx_compute_next_move( engine_ctx_t* ctx );
+void  ctx_undo_move( engine_ctx_t* ctx );
+void  ctx_redo_move( engine_ctx_t* ctx );
+void  ctx_set_time_budget( engine_ctx_t* ctx, long ms );
+int   ctx_game_state( engine_ctx_t* ctx );
+char* ctx_engine_move_str( engine_ctx_t* ctx );
+int   ctx_play( engine_ctx_t* ctx );
+int   ctx_search_stats( engine_ctx_t* ctx, char* json, int size );  // Of the last search
+void  send_profile( void );  // Built with -DPROFILE: cycles spent in the hot functions
+
+// Move generation test: number of boards at 'depth' moves from the board (perft)
+uint64_t ctx_perft( engine_ctx_t* ctx, int depth, int divide, int hash_mb );
+
+// Search speed test: number of moves searched in the bench positions (in its own game and table)
+uint64_t bench( int depth, int hash_mb );
+
+// Test suites: search an EPD position with bm (best moves) or am (avoid moves)
+typedef struct {
+    char id[32];
+    char move[8];   // Move played
+    int  solved;
+    long tts_ms, tts_moves;  // Time and moves searched when a solution was found and kept
+} epd_result_t;
+
+int   ctx_epd_search( engine_ctx_t* ctx, char* epd, long ms, long max_moves, epd_result_t* res );
+
+// The same functions on the single game of the play interfaces,
+// whose state is in the common variables above
 
 void  init_game( char* FEN_string );
 int   try_move_str( char *move_str );
@@ -51,11 +92,14 @@ void  user_redo_move( void );
 void  set_possible_moves_board( int l, int c);
 char  get_possible_moves_board( int l, int c);
 char* get_move_str( int play);
+uint64_t perft( int depth, int divide );
+int   search_stats( char* json, int size );
 
 void log_info( const char* str );
 void send_str( const char* str );
 
-#define log_info_va( ... ) do { char str_va[64]; sprintf( str_va, __VA_ARGS__); log_info(str_va); } while(0)
-#define send_str_va( ... ) do { char str_va[64]; sprintf( str_va, __VA_ARGS__); send_str(str_va); } while(0)
+// (a longer message is cut)
+#define log_info_va( ... ) do { char str_va[256]; snprintf( str_va, sizeof(str_va), __VA_ARGS__); log_info(str_va); } while(0)
+#define send_str_va( ... ) do { char str_va[256]; snprintf( str_va, sizeof(str_va), __VA_ARGS__); send_str(str_va); } while(0)
 
 #endif
@@ -59,17 +59,18 @@ char en_passant[MAX_TURNS];
 #define ALL_CASTLES  3
 char castles[MAX_TURNS + 2];  // (even index: white castle, odd index: black castle)
 
-// Move structure
-#define PROMOTE    1
-#define EN_PASSANT 2
+// Move structure: the book moves are played as is by engine.c, keep the same values
+#define EN_PASSANT 1
+#define PROMO_N    2  // set to be KNIGHT - PAWN
 #define L_ROOK     3
 #define R_ROOK     4
-#define BR_CASTLE  5
-#define BL_CASTLE  6
-#define B_PAWN2    7
+#define PROMO_Q    5  // set to be QUEEN - PAWN
+#define BR_CASTLE  6
+#define BL_CASTLE  7
 #define WR_CASTLE  8
 #define WL_CASTLE  9
-#define W_PAWN2    10
+#define B_PAWN2    10
+#define W_PAWN2    11
 
 struct move_t {
     union {
@@ -121,31 +122,49 @@ void init_game(void)
 //
 //---------------------------------------------------------------------------
 
-uint64_t pengyhash(const void* p, size_t size, uint32_t seed)
+// Zobrist keys: must be the same as the ones generated by engine.c
+uint64_t zobrist_piece[COLORS][BOARD_SIZE];
+uint64_t zobrist_castle[2][ALL_CASTLES + 1];
+uint64_t zobrist_en_passant[BOARD_SIZE];
+uint64_t zobrist_side;
+
+uint64_t splitmix64(uint64_t* state)
 {
-    uint64_t b[4] = {0};
-    uint64_t s[4] = {0, 0, 0, size};
-    int i;
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
 
-    for (; size >= 32; size -= 32, p = (const char*)p + 32) {
-        memcpy(b, p, 32);
+void init_zobrist(void)
+{
+    uint64_t state = 0x1234567890ABCDEFULL;
+    int piece, sq, c;
 
-        s[1] = (s[0] += s[1] + b[3]) + (s[1] << 14 | s[1] >> 50);
-        s[3] = (s[2] += s[3] + b[2]) + (s[3] << 23 | s[3] >> 41);
-        s[3] = (s[0] += s[3] + b[1]) ^ (s[3] << 16 | s[3] >> 48);
-        s[1] = (s[2] += s[1] + b[0]) ^ (s[1] << 40 | s[1] >> 24);
+    memset(zobrist_piece, 0, sizeof(zobrist_piece));
+    memset(zobrist_en_passant, 0, sizeof(zobrist_en_passant));
+
+    for (piece = W_PAWN; piece < COLORS; piece++) {
+        if ((piece & TYPE) < PAWN) continue;
+        for (sq = 0; sq < BOARD_SIZE - 2; sq++) zobrist_piece[piece][sq] = splitmix64(&state);
     }
+    for (c = 0; c < 2; c++)
+        for (sq = 0; sq <= ALL_CASTLES; sq++) zobrist_castle[c][sq] = splitmix64(&state);
+    for (sq = 20; sq < 60; sq++) zobrist_en_passant[sq] = splitmix64(&state);
+    zobrist_side = splitmix64(&state);
+}
 
-    memcpy(b, p, size);
+uint64_t compute_hash(void)
+{
+    uint64_t hash = (play & 1) ? zobrist_side : 0;
 
-    for (i = 0; i < 6; i++) {
-        s[1] = (s[0] += s[1] + b[3]) + (s[1] << 14 | s[1] >> 50) + seed;
-        s[3] = (s[2] += s[3] + b[2]) + (s[3] << 23 | s[3] >> 41);
-        s[3] = (s[0] += s[3] + b[1]) ^ (s[3] << 16 | s[3] >> 48);
-        s[1] = (s[2] += s[1] + b[0]) ^ (s[1] << 40 | s[1] >> 24);
-    }
+    for (int sq = 0; sq < BOARD_SIZE - 2; sq++)
+        if (B(sq) & COLORS) hash ^= zobrist_piece[(int)B(sq)][sq];
 
-    return s[0] + s[1] + s[2] + s[3];
+    hash ^= zobrist_castle[play & 1][(int)castles[play]];
+    hash ^= zobrist_castle[(play & 1) ^ 1][(int)castles[play + 1]];
+    hash ^= zobrist_en_passant[(int)en_passant[play]];
+    return hash;
 }
 
 //---------------------------------------------------------------------------
@@ -187,8 +206,9 @@ void do_move(struct move_t m)
         B(70) = 0;
         B(73) = B_ROOK;
         break;
-    case PROMOTE:
-        B(m.to) |= QUEEN;
+    case PROMO_Q:
+    case PROMO_N:
+        B(m.to) += m.special;  // Because PROMO_Q = QUEEN - PAWN and PROMO_N = KNIGHT - PAWN
         break;
     case W_PAWN2:
         en_passant[play] = m.from + 10;  // notice "en passant" possibility
@@ -373,9 +393,11 @@ void main(void)
     char* ptr;
     char* end_ptr;
     struct move_t move;
-    int wn, len, i, nb_h = 0, m, to, trace = 0;
+    int wn, len, i, nb_h = 0, m, to, promo, trace = 0;
     char piece;
 
+    init_zobrist();
+
     FILE* f = fopen("openings.txt", "r");
     if (f == NULL) {
         printf("could not open openings.txt\n");
@@ -391,9 +413,8 @@ void main(void)
             init_game();
 
             for (ptr = line, wn = 0; wn < 32 && *ptr >= ' '; wn++) {
-                // compute the board hash. Seed = castles + en_passant + side to play...
-                uint32_t seed = (en_passant[play] << 24) + (castles[play] << 16) + (castles[play + 1] << 8) + (play & 1);
-                uint64_t hash = pengyhash((void*)board_ptr, BOARD_SIZE - 2, seed);
+                // compute the board Zobrist key
+                uint64_t hash = compute_hash();
 
                 // A priori, no info about 'from' square is given
                 col = -1;
@@ -422,6 +443,7 @@ void main(void)
                 int init_len  = len;
 
                 // convert castle moves
+                move.val = 0;
                 if (len == 5 && !strncmp(ptr, "O-O-O", 5)) {
                     move.from    = (play & 1) ? 74 : 4;
                     move.to      = (play & 1) ? 72 : 2;
@@ -449,10 +471,12 @@ void main(void)
 
                     // handle characters after the destination info:
                     // detect promotion and skip +, ++, #, etc
+                    promo = 0;
                     while (1) {
                         char ch = *(ptr + len - 1);
                         if (ch >= '1' && ch <= '8') break;
-                        if (ch >= 'b' && ch <= 'r') move.special = PROMOTE;  // TODO: support promotion to other than qween...
+                        if (ch == 'N') promo = PROMO_N;
+                        else if (ch >= 'B' && ch <= 'R') promo = PROMO_Q;  // (promotion to bishop or rook played as queen)
                         len--;
                     }
 
@@ -472,7 +496,12 @@ void main(void)
                     while (*ptr > ' ') ptr++;
 
                     // find which move corresponds to all this information
-                    find_move_to(piece, to, &move);
+                    // and set the same "special" as the engine would
+                    if (find_move_to(piece, to, &move)) {
+                        if (promo) move.special = promo;
+                        if ((piece & TYPE) == ROOK && (move.from == 0 || move.from == 70)) move.special = L_ROOK;
+                        if ((piece & TYPE) == ROOK && (move.from == 7 || move.from == 77)) move.special = R_ROOK;
+                    }
                 }
                 if (move.val == 0) {
                     printf("move = 0 for this line !?! init_len %d first_ch %d, piece %d col %d lig %d to %d len %d\n",
@@ -531,7 +560,7 @@ void main(void)
 
     f = fopen("book.h", "w");
     fprintf(f, "struct book_t {\n");
-    fprintf(f, "    uint64_t      hash;  // Pengy hash\n");
+    fprintf(f, "    uint64_t      hash;  // Zobrist key\n");
     fprintf(f, "    int32_t       nb_moves;\n");
     fprintf(f, "    int32_t       move[10];\n");
     fprintf(f, "} book_t;\n");
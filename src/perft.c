@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <sys/time.h>
+#include "engine.h"
+
+//------------------------------------------------------------------------------------
+// Standalone move generation test and speed measurement:
+//   perft [-t threads] [-hash mb] [depth [FEN]]
+// Without FEN, runs the standard perft positions and checks the node counts.
+//------------------------------------------------------------------------------------
+
+void log_info( const char* str )
+{
+    (void) str;
+}
+
+void send_str( const char* str )
+{
+    fputs( str, stdout );
+}
+
+// The engine only generates queen and knight promotions: where rook or bishop
+// promotions are possible, its counts are below the published ones
+static struct {
+    char* FEN;
+    int   depth;
+    uint64_t nodes;
+} positions[] = {
+    { "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",                 5, 4865609 },
+    { "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",     4, 4078017 },  // 4085603
+    { "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",                                6, 11026307 }, // 11030083
+    { "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",         4, 354089 },   // 422333
+    { "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",                4, 1918444 },  // 2103487
+    { "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 4, 3894594 },
+};
+
+static long ms_since( struct timeval* tv0 )
+{
+    struct timeval tv1;
+    gettimeofday( &tv1, NULL );
+    return (tv1.tv_sec - tv0->tv_sec) * 1000 + (tv1.tv_usec - tv0->tv_usec) / 1000;
+}
+
+static uint64_t run( engine_ctx_t* ctx, char* FEN, int depth, int divide, int hash_mb, long* ms )
+{
+    struct timeval tv0;
+
+    ctx_init_game( ctx, FEN );
+    gettimeofday( &tv0, NULL );
+    uint64_t nodes = ctx_perft( ctx, depth, divide, hash_mb );
+    *ms = ms_since( &tv0 );
+    return nodes;
+}
+
+int main( int argc, char* argv[] )
+{
+    int i = 1, hash_mb = 0, errors = 0;
+    long ms, total_ms = 0;
+    uint64_t nodes, total_nodes = 0;
+
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if      (!strcmp(argv[i], "-t"))    nb_threads = atoi( argv[i + 1] );
+        else if (!strcmp(argv[i], "-hash")) hash_mb    = atoi( argv[i + 1] );
+    }
+    if (nb_threads < 1)           nb_threads = 1;
+    if (nb_threads > MAX_THREADS) nb_threads = MAX_THREADS;
+
+    set_table_size( 1 );  // The search table is not used
+    engine_ctx_t* ctx = new_engine_ctx();
+    if (ctx == NULL) return 1;
+
+    // One position given on the command line: divide it
+    if (i < argc) {
+        nodes = run( ctx, i + 1 < argc ? argv[i + 1] : NULL, atoi( argv[i] ), 1, hash_mb, &ms );
+        printf( "\nnodes %llu, %ld ms, %.2f Mnps\n", (unsigned long long)nodes, ms, ms ? nodes / (1000.0 * ms) : 0.0 );
+        free_engine_ctx( ctx );
+        return 0;
+    }
+
+    printf( "%d thread(s), hash %d MB\n", nb_threads, hash_mb );
+    for (i = 0; i < (int)(sizeof(positions) / sizeof(positions[0])); i++) {
+        nodes = run( ctx, positions[i].FEN, positions[i].depth, 0, hash_mb, &ms );
+        printf( "%d: depth %d %11llu nodes %6ld ms %7.2f Mnps %s\n", i + 1, positions[i].depth,
+                (unsigned long long)nodes, ms, ms ? nodes / (1000.0 * ms) : 0.0, nodes == positions[i].nodes ? "ok" : "MISMATCH" );
+        if (nodes != positions[i].nodes) errors++;
+        total_nodes += nodes;
+        total_ms    += ms;
+    }
+    printf( "total %llu nodes %ld ms %.2f Mnps\n", (unsigned long long)total_nodes, total_ms, total_ms ? total_nodes / (1000.0 * total_ms) : 0.0 );
+
+    free_engine_ctx( ctx );
+    return errors != 0;
+}